@@ -0,0 +1,345 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/spinlock.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include "bench.h"
+#include "debug.h"
+
+#ifndef CONFIG_BENCH_DEBUG_LEVEL
+#define CONFIG_BENCH_DEBUG_LEVEL INFO
+#endif
+
+#define log(lvl,fmt, ...) _log("BENCH",CONFIG_BENCH_DEBUG_LEVEL,lvl,fmt, ##__VA_ARGS__)
+
+typedef struct bench_stat_t {
+   u64 count;
+   u64 total;
+   u64 min;
+   u64 max;
+   u64 last;
+} bench_stat_t;
+
+typedef struct bench_lz4_t {
+   u64 count;
+   u64 skipped;
+   u64 bytes_in;
+   u64 bytes_out;
+   u64 ns;
+} bench_lz4_t;
+
+static const char *bench_counter_name[BENCH_NB_COUNTERS] = {
+   "driver_int_superseded",
+   "gadget_int_superseded",
+   "in_deadline_missed",
+   "out_deadline_missed",
+};
+
+static const char *bench_stage_name[BENCH_NB_STAGES] = {
+   "probe_to_configured",
+   "build_init_pkt",
+   "transport",
+   "parse_init_pkt",
+   "register",
+   "bind",
+   "ep0_roundtrip",
+   "enable_interface",
+};
+
+static struct bench_state_t {
+   spinlock_t lock;
+   bench_stat_t stats[BENCH_NB_STAGES];
+   u64 probe;     // Time of the last driver_probe, 0 once configured
+   u64 transport; // Time the last init pkt has been sent
+   u64 ep0;       // Time of the last setup received on ep0
+   bench_lz4_t compress;
+   bench_lz4_t decompress;
+   atomic64_t counters[BENCH_NB_COUNTERS];
+   struct dentry *dir;
+} bench_state;
+
+
+u64
+bench_now(void)
+{
+   return ktime_to_ns(ktime_get());
+}
+
+void
+bench_add(bench_stage_t stage, u64 start)
+{
+   unsigned long flags;
+   bench_stat_t *s;
+   u64 delta;
+
+   if (!start) {
+      return;
+   }
+   delta = bench_now() - start;
+
+   spin_lock_irqsave(&bench_state.lock,flags);
+   s = &bench_state.stats[stage];
+   if (!s->count || delta < s->min) {
+      s->min = delta;
+   }
+   if (delta > s->max) {
+      s->max = delta;
+   }
+   s->total += delta;
+   s->last = delta;
+   s->count++;
+   spin_unlock_irqrestore(&bench_state.lock,flags);
+}
+
+void
+bench_probe(void)
+{
+   bench_state.probe = bench_now();
+}
+
+void
+bench_configured(void)
+{
+   u64 start = xchg(&bench_state.probe,0);
+   bench_add(BENCH_PROBE_TO_CONFIGURED,start);
+}
+
+void
+bench_transport_start(void)
+{
+   bench_state.transport = bench_now();
+}
+
+void
+bench_transport_stop(void)
+{
+   u64 start = xchg(&bench_state.transport,0);
+   bench_add(BENCH_TRANSPORT,start);
+}
+
+void
+bench_ep0_start(void)
+{
+   bench_state.ep0 = bench_now();
+}
+
+void
+bench_ep0_stop(void)
+{
+   u64 start = xchg(&bench_state.ep0,0);
+   bench_add(BENCH_EP0_ROUNDTRIP,start);
+}
+
+static void
+bench_lz4_add(bench_lz4_t *s, size_t in, size_t out, u64 start)
+{
+   u64 delta = bench_now() - start;
+   unsigned long flags;
+
+   spin_lock_irqsave(&bench_state.lock,flags);
+   s->count++;
+   if (!out) {
+      s->skipped++;
+   }
+   s->bytes_in += in;
+   s->bytes_out += out ? out : in;
+   s->ns += delta;
+   spin_unlock_irqrestore(&bench_state.lock,flags);
+}
+
+void
+bench_compress(size_t in, size_t out, u64 start)
+{
+   bench_lz4_add(&bench_state.compress,in,out,start);
+}
+
+void
+bench_decompress(size_t in, size_t out, u64 start)
+{
+   bench_lz4_add(&bench_state.decompress,in,out,start);
+}
+
+void
+bench_count(bench_counter_t counter)
+{
+   atomic64_inc(&bench_state.counters[counter]);
+}
+
+/* -------------------------------------------------------------------------------
+ *
+ * Debugfs export
+ *
+ *--------------------------------------------------------------------------------
+ */
+
+#ifdef CONFIG_DEBUG_FS
+static int
+bench_show(struct seq_file *s, void *unused)
+{
+   bench_stat_t stats[BENCH_NB_STAGES];
+   unsigned long flags;
+   int i;
+
+   spin_lock_irqsave(&bench_state.lock,flags);
+   memcpy(stats,bench_state.stats,sizeof stats);
+   spin_unlock_irqrestore(&bench_state.lock,flags);
+
+   seq_puts(s,"stage count total_ns min_ns max_ns last_ns\n");
+   for (i=0; i<BENCH_NB_STAGES; i++) {
+      seq_printf(s,"%s %llu %llu %llu %llu %llu\n",bench_stage_name[i],
+                 stats[i].count,stats[i].total,stats[i].min,stats[i].max,stats[i].last);
+   }
+   return 0;
+}
+
+static int
+bench_open(struct inode *inode, struct file *file)
+{
+   return single_open(file,bench_show,NULL);
+}
+
+/* Any write resets the statistics */
+static ssize_t
+bench_write(struct file *file, const char __user *buf, size_t len, loff_t *off)
+{
+   unsigned long flags;
+
+   spin_lock_irqsave(&bench_state.lock,flags);
+   memset(bench_state.stats,0,sizeof bench_state.stats);
+   spin_unlock_irqrestore(&bench_state.lock,flags);
+   return len;
+}
+
+static const struct file_operations bench_fops = {
+   .owner = THIS_MODULE,
+   .open = bench_open,
+   .read = seq_read,
+   .write = bench_write,
+   .llseek = seq_lseek,
+   .release = single_release,
+};
+
+static int
+bench_lz4_show(struct seq_file *s, void *unused)
+{
+   bench_lz4_t st[2];
+   unsigned long flags;
+   int i;
+
+   spin_lock_irqsave(&bench_state.lock,flags);
+   st[0] = bench_state.compress;
+   st[1] = bench_state.decompress;
+   spin_unlock_irqrestore(&bench_state.lock,flags);
+
+   seq_puts(s,"way count skipped bytes_in bytes_out total_ns\n");
+   for (i=0; i<2; i++) {
+      seq_printf(s,"%s %llu %llu %llu %llu %llu\n",i ? "decompress" : "compress",
+                 st[i].count,st[i].skipped,st[i].bytes_in,st[i].bytes_out,st[i].ns);
+   }
+   return 0;
+}
+
+static int
+bench_lz4_open(struct inode *inode, struct file *file)
+{
+   return single_open(file,bench_lz4_show,NULL);
+}
+
+static ssize_t
+bench_lz4_write(struct file *file, const char __user *buf, size_t len, loff_t *off)
+{
+   unsigned long flags;
+
+   spin_lock_irqsave(&bench_state.lock,flags);
+   memset(&bench_state.compress,0,sizeof bench_state.compress);
+   memset(&bench_state.decompress,0,sizeof bench_state.decompress);
+   spin_unlock_irqrestore(&bench_state.lock,flags);
+   return len;
+}
+
+static const struct file_operations bench_lz4_fops = {
+   .owner = THIS_MODULE,
+   .open = bench_lz4_open,
+   .read = seq_read,
+   .write = bench_lz4_write,
+   .llseek = seq_lseek,
+   .release = single_release,
+};
+
+static int
+bench_counters_show(struct seq_file *s, void *unused)
+{
+   int i;
+
+   for (i=0; i<BENCH_NB_COUNTERS; i++) {
+      seq_printf(s,"%s %lld\n",bench_counter_name[i],(long long)atomic64_read(&bench_state.counters[i]));
+   }
+   return 0;
+}
+
+static int
+bench_counters_open(struct inode *inode, struct file *file)
+{
+   return single_open(file,bench_counters_show,NULL);
+}
+
+static ssize_t
+bench_counters_write(struct file *file, const char __user *buf, size_t len, loff_t *off)
+{
+   int i;
+
+   for (i=0; i<BENCH_NB_COUNTERS; i++) {
+      atomic64_set(&bench_state.counters[i],0);
+   }
+   return len;
+}
+
+static const struct file_operations bench_counters_fops = {
+   .owner = THIS_MODULE,
+   .open = bench_counters_open,
+   .read = seq_read,
+   .write = bench_counters_write,
+   .llseek = seq_lseek,
+   .release = single_release,
+};
+#endif
+
+int
+bench_init(void)
+{
+   int i;
+
+   spin_lock_init(&bench_state.lock);
+   memset(bench_state.stats,0,sizeof bench_state.stats);
+   bench_state.probe = 0;
+   bench_state.transport = 0;
+   bench_state.ep0 = 0;
+   memset(&bench_state.compress,0,sizeof bench_state.compress);
+   memset(&bench_state.decompress,0,sizeof bench_state.decompress);
+   for (i=0; i<BENCH_NB_COUNTERS; i++) {
+      atomic64_set(&bench_state.counters[i],0);
+   }
+   bench_state.dir = NULL;
+
+#ifdef CONFIG_DEBUG_FS
+   bench_state.dir = debugfs_create_dir("ubq_core",NULL);
+   if (IS_ERR_OR_NULL(bench_state.dir)) {
+      log(WRN,"Unable to create debugfs directory, no latency export");
+      bench_state.dir = NULL;
+      return 0;
+   }
+   debugfs_create_file("enum_latency",0600,bench_state.dir,NULL,&bench_fops);
+   debugfs_create_file("compression",0600,bench_state.dir,NULL,&bench_lz4_fops);
+   debugfs_create_file("counters",0600,bench_state.dir,NULL,&bench_counters_fops);
+#endif
+   return 0;
+}
+
+void
+bench_exit(void)
+{
+   debugfs_remove_recursive(bench_state.dir);
+   bench_state.dir = NULL;
+}
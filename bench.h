@@ -0,0 +1,58 @@
+#ifndef __UBQ_BENCH_H
+#define __UBQ_BENCH_H
+
+#include <linux/types.h>
+
+/*
+ * Enumeration latency instrumentation
+ *
+ * Every stage keeps count/total/min/max/last durations in nanoseconds.
+ * Results are exported in debugfs (ubq_core/enum_latency), one line per stage.
+ */
+typedef enum bench_stage_t {
+   BENCH_PROBE_TO_CONFIGURED, // driver_probe -> SET_CONFIGURATION seen by gadget
+   BENCH_BUILD_INIT_PKT,
+   BENCH_TRANSPORT,           // init pkt sent by driver -> received by gadget
+   BENCH_PARSE_INIT_PKT,
+   BENCH_REGISTER,            // ubq_register, including ubq_bind
+   BENCH_BIND,
+   BENCH_EP0_ROUNDTRIP,       // setup received -> response from userland
+   BENCH_ENABLE_INTERFACE,
+   BENCH_NB_STAGES
+} bench_stage_t;
+
+u64 bench_now(void);
+void bench_add(bench_stage_t stage, u64 start);
+
+// Enumeration reference points, shared between driver and gadget side
+void bench_probe(void);
+void bench_configured(void);
+void bench_transport_start(void);
+void bench_transport_stop(void);
+void bench_ep0_start(void);
+void bench_ep0_stop(void);
+
+/*
+ * Payload compression cost, exported in debugfs (ubq_core/compression)
+ * out is 0 when compressing was not worth it and the payload went as is
+ */
+void bench_compress(size_t in, size_t out, u64 start);
+void bench_decompress(size_t in, size_t out, u64 start);
+
+/*
+ * Event counters, exported in debugfs (ubq_core/counters)
+ */
+typedef enum bench_counter_t {
+   BENCH_DRIVER_INT_SUPERSEDED, // Interrupt IN report dropped for a newer one
+   BENCH_GADGET_INT_SUPERSEDED,
+   BENCH_IN_DEADLINE_MISSED,    // Message forwarded without userland verdict
+   BENCH_OUT_DEADLINE_MISSED,
+   BENCH_NB_COUNTERS
+} bench_counter_t;
+
+void bench_count(bench_counter_t counter);
+
+int bench_init(void);
+void bench_exit(void);
+
+#endif
@@ -0,0 +1,287 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+
+""" Enumeration latency benchmark
+
+Usage
+  bench.py [--module ubq_core.ko] [--runs N] [--timeout S] [--bulk BYTES] [--param name=value]...
+
+Help
+  Needs root. Relays a g_zero device through ubq_core using dummy_hcd:
+
+    dummy_udc.0 <- g_zero       (plays the physical device)
+    dummy_hcd.0 -> ubq_driver   (driver side of ubq_core)
+    loopback peer               (this script, relays DRIVER <-> GADGET messages)
+    dummy_udc.1 <- ubq_gadget   (gadget side of ubq_core)
+    dummy_hcd.1                 (host enumerating the relayed device)
+
+  Both sides are switched to wire format v2 first (SET_VERSION), the driver
+  side once its first frame gives its address. Each run re-plugs g_zero,
+  waits until the relayed device is configured, then writes and reads --bulk
+  bytes on its source/sink bulk endpoints through usbfs.
+  Results of ubq_core/enum_latency are printed as JSON on stdout, along with
+  bulk throughput and ubq_core/compression (payload ratio and CPU time) when
+  module has it.
+  --param is given to insmod, e.g. --param compress_bulk=1
+
+Requirements
+  dummy_hcd, g_zero, debugfs mounted, 192.168.64.1 configured locally
+  (ip addr add 192.168.64.1/32 dev lo)
+"""
+
+import argparse
+import ctypes
+import fcntl
+import glob
+import json
+import os
+import select
+import socket
+import struct
+import subprocess
+import sys
+import threading
+import time
+
+DRIVER_PORT = 64240
+GADGET_ADDR = ("127.0.0.1", 64241)
+LATENCY = "/sys/kernel/debug/ubq_core/enum_latency"
+COMPRESSION = "/sys/kernel/debug/ubq_core/compression"
+
+# msg.h, v1 frames are msg_t from its size field, native sizes
+MANAGEMENT = 2
+SET_VERSION = 3
+WIRE_V2 = 2
+V1_MNG = struct.Struct("@Nii")
+
+# usbdevice_fs.h
+USBDEVFS_BULK = (3 << 30) | (struct.calcsize("@IIIP") << 16) | (ord("U") << 8) | 2
+USBDEVFS_CLAIMINTERFACE = (2 << 30) | (4 << 16) | (ord("U") << 8) | 15
+ZERO_ID = ("0525", "a4a0")
+BULK_CHUNK = 4096
+
+
+def run(*cmd):
+    subprocess.check_call(cmd)
+
+
+def read_latency():
+    stats = {}
+    with open(LATENCY) as f:
+        header = f.readline().split()
+        for line in f:
+            fields = line.split()
+            stats[fields[0]] = dict(zip(header[1:], map(int, fields[1:])))
+    return stats
+
+
+def reset_latency():
+    with open(LATENCY, "w") as f:
+        f.write("0")
+
+
+def read_compression():
+    """ Add ratio (bytes_out / bytes_in) and ns per input byte to each way """
+    if not os.path.exists(COMPRESSION):
+        return None
+    stats = {}
+    with open(COMPRESSION) as f:
+        header = f.readline().split()
+        for line in f:
+            fields = line.split()
+            way = dict(zip(header[1:], map(int, fields[1:])))
+            if way["bytes_in"]:
+                way["ratio"] = way["bytes_out"] / way["bytes_in"]
+                way["ns_per_byte"] = way["total_ns"] / way["bytes_in"]
+            stats[fields[0]] = way
+    return stats
+
+
+def reset_compression():
+    if os.path.exists(COMPRESSION):
+        with open(COMPRESSION, "w") as f:
+            f.write("0")
+
+
+def set_version_frame():
+    return V1_MNG.pack(V1_MNG.size + 4, MANAGEMENT, SET_VERSION) + struct.pack("<I", WIRE_V2)
+
+
+def is_set_version(data):
+    """ Answer comes in v1, before the side switches """
+    if len(data) < V1_MNG.size + 4:
+        return False
+    _, mtype, mng = V1_MNG.unpack_from(data)
+    return mtype == MANAGEMENT and mng == SET_VERSION
+
+
+class Loopback:
+    """ Forward every datagram between driver and gadget channels unmodified """
+
+    def __init__(self):
+        self.driver = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.driver.bind(("0.0.0.0", DRIVER_PORT))
+        self.gadget = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.driver_addr = None
+        self.running = False
+
+    def negotiate(self, timeout):
+        """ Switch both sides to v2, v1 frames seen meanwhile are dropped """
+        deadline = time.time() + timeout
+        self.gadget.sendto(set_version_frame(), GADGET_ADDR)
+        pending = {self.driver, self.gadget}
+        while pending and time.time() < deadline:
+            r, _, _ = select.select([self.driver, self.gadget], [], [], 0.1)
+            for s in r:
+                data, addr = s.recvfrom(65536)
+                if s is self.driver and self.driver_addr is None:
+                    self.driver_addr = addr
+                    self.driver.sendto(set_version_frame(), addr)
+                elif is_set_version(data):
+                    pending.discard(s)
+        return not pending
+
+    def poll(self, timeout):
+        r, _, _ = select.select([self.driver, self.gadget], [], [], timeout)
+        for s in r:
+            data, addr = s.recvfrom(65536)
+            if s is self.driver:
+                self.driver_addr = addr
+                self.gadget.sendto(data, GADGET_ADDR)
+            elif self.driver_addr is not None:
+                self.driver.sendto(data, self.driver_addr)
+
+    def start(self):
+        """ Relay from a thread, bulk transfers below block """
+        self.running = True
+        self.thread = threading.Thread(target=self.relay, daemon=True)
+        self.thread.start()
+
+    def relay(self):
+        while self.running:
+            self.poll(0.01)
+
+    def stop(self):
+        self.running = False
+        self.thread.join()
+
+
+def replug(timeout):
+    before = read_latency()["probe_to_configured"]["count"]
+    run("modprobe", "-r", "g_zero")
+    run("modprobe", "g_zero")
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        time.sleep(0.01)
+        if read_latency()["probe_to_configured"]["count"] > before:
+            return True
+    return False
+
+
+def sysfs_read(path):
+    with open(path) as f:
+        return f.read().strip()
+
+
+def relayed_zero():
+    """ g_zero as enumerated through ubq_gadget, not the one ubq_driver holds """
+    for dev in glob.glob("/sys/bus/usb/devices/*"):
+        if not os.path.exists(dev + "/idVendor"):
+            continue
+        if (sysfs_read(dev + "/idVendor"), sysfs_read(dev + "/idProduct")) != ZERO_ID:
+            continue
+        intf = dev + ":%s.0" % sysfs_read(dev + "/bConfigurationValue")
+        driver = os.path.join(intf, "driver")
+        if os.path.exists(driver) and os.path.basename(os.readlink(driver)) == "ubq_driver":
+            continue
+        return dev, intf
+    return None, None
+
+
+def bulk_endpoints(intf):
+    eps = {}
+    for ep in glob.glob(intf + "/ep_*"):
+        if sysfs_read(ep + "/type") == "Bulk":
+            eps[sysfs_read(ep + "/direction")] = int(os.path.basename(ep)[3:], 16)
+    return eps.get("in"), eps.get("out")
+
+
+def bulk(fd, ep, buf, timeout):
+    xfer = struct.pack("@IIIP", ep, len(buf), int(timeout * 1000), ctypes.addressof(buf))
+    return fcntl.ioctl(fd, USBDEVFS_BULK, xfer)
+
+
+def bulk_traffic(size, timeout):
+    """ Write then read size bytes on g_zero sink/source, return seconds taken """
+    dev, intf = relayed_zero()
+    if dev is None:
+        raise RuntimeError("relayed g_zero not found")
+    ep_in, ep_out = bulk_endpoints(intf)
+    driver = os.path.join(intf, "driver")
+    if os.path.exists(driver):
+        with open(driver + "/unbind", "w") as f:
+            f.write(os.path.basename(intf))
+    path = "/dev/bus/usb/%03d/%03d" % (int(sysfs_read(dev + "/busnum")), int(sysfs_read(dev + "/devnum")))
+    fd = os.open(path, os.O_RDWR)
+    try:
+        fcntl.ioctl(fd, USBDEVFS_CLAIMINTERFACE, struct.pack("@I", 0))
+        out = ctypes.create_string_buffer(bytes(i % 63 for i in range(BULK_CHUNK)), BULK_CHUNK)
+        inb = ctypes.create_string_buffer(BULK_CHUNK)
+        times = {}
+        for way, ep, buf in (("out", ep_out, out), ("in", ep_in | 0x80, inb)):
+            start = time.time()
+            for _ in range(0, size, BULK_CHUNK):
+                bulk(fd, ep, buf, timeout)
+            times[way] = time.time() - start
+        return times
+    finally:
+        os.close(fd)
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--module", default="ubq_core.ko")
+    parser.add_argument("--runs", type=int, default=10)
+    parser.add_argument("--timeout", type=float, default=10.0)
+    parser.add_argument("--bulk", type=int, default=1 << 20)
+    parser.add_argument("--param", action="append", default=[])
+    args = parser.parse_args()
+
+    run("modprobe", "dummy_hcd", "num=2")
+    run("modprobe", "g_zero")
+    run("insmod", args.module, *args.param)
+    loop = Loopback()
+    try:
+        if not loop.negotiate(args.timeout):
+            raise RuntimeError("wire format v2 not negotiated")
+        loop.start()
+        reset_latency()
+        reset_compression()
+        failures = 0
+        bulk_s = {"out": 0.0, "in": 0.0}
+        for _ in range(args.runs):
+            if not replug(args.timeout):
+                failures += 1
+                continue
+            for way, s in bulk_traffic(args.bulk, args.timeout).items():
+                bulk_s[way] += s
+        done = args.runs - failures
+        result = {"runs": args.runs, "failures": failures, "stages": read_latency(),
+                  "bulk": {way: {"bytes": args.bulk * done, "seconds": s}
+                           for way, s in bulk_s.items()}}
+        compression = read_compression()
+        if compression is not None:
+            result["compression"] = compression
+        json.dump(result, sys.stdout, indent=2)
+        sys.stdout.write("\n")
+    finally:
+        if loop.running:
+            loop.stop()
+        subprocess.call(["rmmod", os.path.basename(args.module)[:-3]])
+        subprocess.call(["modprobe", "-r", "g_zero"])
+        subprocess.call(["modprobe", "-r", "dummy_hcd"])
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
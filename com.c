@@ -7,141 +7,1332 @@
 #include <linux/inet.h>
 #include <linux/uio.h>
 #include <linux/version.h>
+#include <linux/cpumask.h>
+#include <linux/numa.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/vmalloc.h>
+#include <linux/sched.h>
 
 #include "msg.h"
 #include "com.h"
 #include "com_udp.h"
+#include "com_genl.h"
+#include "com_vsock.h"
+#include "com_tcp.h"
 #include "debug.h"
+#include "bench.h"
 
-#define MAX_SIZE_MSG 16000
+#if IS_ENABLED(CONFIG_LZ4_COMPRESS) && IS_ENABLED(CONFIG_LZ4_DECOMPRESS) && LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
+#include <linux/lz4.h>
+#define COM_LZ4
+#endif
 
+static char *transport = "udp";
+module_param(transport, charp, 0444);
+MODULE_PARM_DESC(transport, "Communication backend with userland (udp, tcp, netlink, vsock)");
 
-typedef struct internal_com_t {
-   com_init_fn init;
-   com_close_fn close;
-   com_send_fn send;
-   com_recv_fn recv;
-} internal_com_t;
+static int flows = 1;
+module_param(flows, int, 0444);
+MODULE_PARM_DESC(flows, "Number of flows per channel, spread by endpoint class (udp only, max 4)");
 
-/* Default operations */
-static internal_com_t conf_com = {
-   (com_init_fn)udp_com_init,
-   (com_close_fn)udp_com_close,
-   (com_send_fn)udp_com_send,
-   (com_recv_fn)udp_com_recv
+static int busy_poll = 0;
+module_param(busy_poll, int, 0444);
+MODULE_PARM_DESC(busy_poll, "Number of leading flows read by a busy-polling thread instead of a work (0 disables it)");
+
+static int busy_poll_cpu = -1;
+module_param(busy_poll_cpu, int, 0444);
+MODULE_PARM_DESC(busy_poll_cpu, "CPU of the first polling thread, next ones on following CPUs (-1: not bound)");
+
+static int busy_poll_usecs = 50;
+module_param(busy_poll_usecs, int, 0444);
+MODULE_PARM_DESC(busy_poll_usecs, "Time spent spinning without data before backing off");
+
+static bool reliable = false;
+module_param(reliable, bool, 0444);
+MODULE_PARM_DESC(reliable, "Sequence, acknowledge and retransmit frames in v2 over udp (userland must send REL_ACK)");
+
+static int rel_rto_usecs = 500;
+module_param(rel_rto_usecs, int, 0444);
+MODULE_PARM_DESC(rel_rto_usecs, "Time before an unacknowledged frame is sent again, doubled on each retry");
+
+static bool compress_bulk = false;
+module_param(compress_bulk, bool, 0444);
+MODULE_PARM_DESC(compress_bulk, "LZ4 compress bulk DATA payloads in v2 (needs CONFIG_LZ4_COMPRESS)");
+
+static int compress_min = 512;
+module_param(compress_min, int, 0444);
+MODULE_PARM_DESC(compress_min, "Smallest bulk payload worth compressing");
+
+static bool tx_sched = false;
+module_param(tx_sched, bool, 0444);
+MODULE_PARM_DESC(tx_sched, "Queue frames per class (control, interrupt, isoc, bulk) and send them by weighted round robin");
+
+static int tx_weights[COM_NB_CLASSES] = { 8, 4, 2, 1 };
+module_param_array(tx_weights, int, NULL, 0444);
+MODULE_PARM_DESC(tx_weights, "Share of each class when all are busy (control,interrupt,isoc,bulk)");
+
+static int tx_queue_max = 256;
+module_param(tx_queue_max, int, 0444);
+MODULE_PARM_DESC(tx_queue_max, "Frames queued per class before sending fails");
+
+static int rx_cpu = -1;
+module_param(rx_cpu, int, 0644);
+MODULE_PARM_DESC(rx_cpu, "CPU receiving on first flow, next flows on following CPUs (-1: spread by default)");
+
+static int tx_cpu = -1;
+module_param(tx_cpu, int, 0644);
+MODULE_PARM_DESC(tx_cpu, "CPU of transmit threads (-1: not bound)");
+
+static bool rt_threads = false;
+module_param(rt_threads, bool, 0444);
+MODULE_PARM_DESC(rt_threads, "Run receive, polling and transmit threads with SCHED_FIFO");
+
+#define COM_TX_QUANTUM 1024
+#define BUSY_POLL_MAX_BACKOFF_US 1000
+#define REL_MAX_BACKOFF 7
+
+/* Available backends, first one is the default */
+static internal_com_t conf_com[] = {
+   {
+      "udp",
+      COM_MAX_FLOWS,
+      1,
+      (com_init_fn)udp_com_init,
+      (com_close_fn)udp_com_close,
+      (com_send_fn)udp_com_send,
+      (com_recv_fn)udp_com_recv
+   },
+   {
+      "tcp",
+      1,
+      0,
+      (com_init_fn)tcp_com_init,
+      (com_close_fn)stream_com_close,
+      (com_send_fn)stream_com_send,
+      (com_recv_fn)stream_com_recv
+   },
+   {
+      "netlink",
+      1,
+      0,
+      (com_init_fn)genl_com_init,
+      (com_close_fn)genl_com_close,
+      (com_send_fn)genl_com_send,
+      (com_recv_fn)genl_com_recv
+   },
+   {
+      "vsock",
+      1,
+      0,
+      (com_init_fn)vsock_com_init,
+      (com_close_fn)stream_com_close,
+      (com_send_fn)stream_com_send,
+      (com_recv_fn)stream_com_recv
+   },
 };
 
-typedef struct {
-   struct work_struct work;
-   void *com;
-} recv_wq_t;
+static internal_com_t*
+find_backend(const char *name)
+{
+   int i;
+
+   for (i=0; i<ARRAY_SIZE(conf_com); i++) {
+      if (!strcmp(conf_com[i].name, name)) {
+         return &conf_com[i];
+      }
+   }
+   com_log("COM",WRN,"Unknown transport %s, using %s",name,conf_com[0].name);
+   return &conf_com[0];
+}
+
+static void com_set_version(com_t *com, msg_t *msg);
+
+
+/*
+  CPU placement
+  rx_cpu and tx_cpu may be changed in sysfs, they apply to next work or frame
+*/
+static int
+com_cpu_valid(int cpu)
+{
+   return cpu >= 0 && cpu < nr_cpu_ids && cpu_online(cpu);
+}
+
+static int
+com_flow_cpu(const com_flow_t *flow)
+{
+   int cpu = READ_ONCE(rx_cpu);
 
+   if (cpu >= 0 && com_cpu_valid(cpu + flow->idx)) {
+      return cpu + flow->idx;
+   }
+   return flow->cpu;
+}
+
+static void
+com_thread_rt(struct task_struct *t)
+{
+   if (!rt_threads) {
+      return;
+   }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,9,0)
+   sched_set_fifo(t);
+#else
+   {
+      struct sched_param p = { .sched_priority = MAX_RT_PRIO / 2 };
+      sched_setscheduler_nocheck(t, SCHED_FIFO, &p);
+   }
+#endif
+}
+
+/*
+  Called by backends owning a receive thread
+*/
+void
+com_rx_thread_setup(struct task_struct *t)
+{
+   int cpu = READ_ONCE(rx_cpu);
+
+   if (com_cpu_valid(cpu)) {
+      set_cpus_allowed_ptr(t, cpumask_of(cpu));
+   }
+   com_thread_rt(t);
+}
+
+
+/*
+  Reliable delivery
+  Sender keeps each frame until a REL_ACK covers it, and sends it again once
+  its timeout expires, or as soon as a later frame is acknowledged first
+  Receiver delivers in order and acknowledges every frame
+*/
+static int
+com_rel_enabled(const com_t *com)
+{
+   return reliable && com->ops->lossy && com->tx_version != WIRE_V1;
+}
+
+static s64
+com_rel_rto(const com_rel_tx_t *e)
+{
+   return (s64)rel_rto_usecs << min(e->retries, REL_MAX_BACKOFF);
+}
+
+static void
+com_rel_arm(com_rel_t *rel)
+{
+   if (!hrtimer_is_queued(&rel->timer)) {
+      hrtimer_start(&rel->timer, ns_to_ktime((u64)rel_rto_usecs * NSEC_PER_USEC), HRTIMER_MODE_REL);
+   }
+}
+
+static enum hrtimer_restart
+com_rel_timer(struct hrtimer *timer)
+{
+   com_rel_t *rel = container_of(timer, com_rel_t, timer);
+   com_flow_t *flow = container_of(rel, com_flow_t, rel);
+
+   queue_work_on(com_flow_cpu(flow), flow->com->wq, &rel->work);
+   return HRTIMER_NORESTART;
+}
+
+// rel->lock held
+static void
+com_rel_free(com_rel_t *rel, u32 seq)
+{
+   com_rel_tx_t *e = &rel->tx[seq % COM_REL_WINDOW];
+
+   if (e->frame && e->seq == seq) {
+      kfree(e->frame);
+      e->frame = NULL;
+   }
+}
 
 /*
   Function executed by workqueue
+  Send again every frame whose timeout expired
 */
 static void
-com_recv(struct work_struct *data)
+com_rel_retransmit(struct work_struct *data)
 {
-   recv_wq_t *work = (recv_wq_t *)data;
-   com_t *com = (com_t*)work->com;
-   ssize_t sz;
+   com_rel_t *rel = container_of(data, com_rel_t, work);
+   com_flow_t *flow = container_of(rel, com_flow_t, rel);
+   com_t *com = flow->com;
+   unsigned long flags;
+   u32 seq, last;
+
+   spin_lock_irqsave(&rel->lock, flags);
+   seq = rel->tx_acked + 1;
+   for (;;) {
+      com_rel_tx_t *e = NULL;
+      size_t len;
+      int err;
+
+      last = atomic_read(&flow->tx_seq);
+      for (; (s32)(seq - last) <= 0; seq++) {
+         e = &rel->tx[seq % COM_REL_WINDOW];
+         if (e->frame && e->seq == seq && ktime_us_delta(ktime_get(), e->sent) >= com_rel_rto(e)) {
+            break;
+         }
+      }
+      if ((s32)(seq - last) > 0) {
+         break;
+      }
 
-   sz = conf_com.recv(com->state,com->msg);
-   if (sz < 0) {
-      com_log(com->id,ERR,"Unable to receive data from userland (err:%d)",sz);
+      len = e->len;
+      memcpy(rel->scratch, e->frame, len);
+      e->sent = ktime_get();
+      if (++e->retries == REL_MAX_BACKOFF) {
+         com_log(com->id,WRN,"Frame %u of flow %d still not acknowledged",seq,flow->idx);
+      }
+      spin_unlock_irqrestore(&rel->lock, flags);
+
+      err = com->ops->send(com->state,flow->idx,rel->scratch,len,0);
+      if (err < 0) {
+         com_log(com->id,ERR,"Unable to send frame %u again [%d]",seq,err);
+      }
+
+      spin_lock_irqsave(&rel->lock, flags);
+      seq++;
+   }
+
+   if (rel->tx_acked != last) {
+      com_rel_arm(rel);
+   }
+   spin_unlock_irqrestore(&rel->lock, flags);
+}
+
+/*
+  Sequence the v2 frame and keep a copy until it is acknowledged
+*/
+static int
+com_rel_send(com_flow_t *flow, char *frame, size_t len, int more)
+{
+   com_t *com = flow->com;
+   com_rel_t *rel = &flow->rel;
+   wire_hdr_t *hdr = (wire_hdr_t *)frame;
+   com_rel_tx_t *e;
+   unsigned long flags;
+   u32 seq;
+
+   spin_lock_irqsave(&rel->lock, flags);
+   seq = atomic_read(&flow->tx_seq) + 1;
+   if (seq - rel->tx_acked > COM_REL_WINDOW) {
+      spin_unlock_irqrestore(&rel->lock, flags);
+      com_log(com->id,WRN,"Retransmit window of flow %d is full",flow->idx);
+      return -ENOBUFS;
+   }
+
+   hdr->flags |= WIRE_F_REL;
+   hdr->seq = cpu_to_le32(seq);
+   e = &rel->tx[seq % COM_REL_WINDOW];
+   e->frame = kmemdup(frame, len, GFP_ATOMIC);
+   if (!e->frame) {
+      spin_unlock_irqrestore(&rel->lock, flags);
+      com_log(com->id,ERR,"Unable to allocate memory");
+      return -ENOMEM;
+   }
+   e->seq = seq;
+   e->len = len;
+   e->retries = 0;
+   e->sent = ktime_get();
+   atomic_set(&flow->tx_seq, seq);
+   com_rel_arm(rel);
+   spin_unlock_irqrestore(&rel->lock, flags);
+
+   return com->ops->send(com->state,flow->idx,frame,len,more);
+}
+
+/*
+  Release what peer received
+  A hole before a selectively acknowledged frame is sent again at once
+*/
+static void
+com_rel_acked(com_flow_t *flow, const msg_t *msg)
+{
+   com_rel_t *rel = &flow->rel;
+   const rel_ack_t *a = (const rel_ack_t *)msg->management_data;
+   u32 cum = le32_to_cpu(a->cum);
+   u32 sack = le32_to_cpu(a->sack);
+   com_rel_tx_t *e;
+   unsigned long flags;
+   int fast = 0;
+   u32 seq;
+   int i;
+
+   spin_lock_irqsave(&rel->lock, flags);
+   // Late acknowledgement, or beyond what was sent
+   if (cum - rel->tx_acked > COM_REL_WINDOW || (s32)(cum - (u32)atomic_read(&flow->tx_seq)) > 0) {
+      spin_unlock_irqrestore(&rel->lock, flags);
       return;
-   } else if (!check_msg(com->msg)) {
+   }
+
+   for (seq = rel->tx_acked + 1; seq != cum + 1; seq++) {
+      com_rel_free(rel, seq);
+   }
+   rel->tx_acked = cum;
+
+   for (i=0; i<COM_REL_WINDOW - 1; i++) {
+      if (sack & BIT(i)) {
+         com_rel_free(rel, cum + 2 + i);
+      }
+   }
+
+   e = &rel->tx[(cum + 1) % COM_REL_WINDOW];
+   if (sack && e->frame && e->seq == cum + 1 && ktime_us_delta(ktime_get(), e->sent) > rel_rto_usecs / 4) {
+      e->sent = ktime_set(0, 0);
+      fast = 1;
+   }
+   spin_unlock_irqrestore(&rel->lock, flags);
+
+   if (fast) {
+      queue_work_on(com_flow_cpu(flow), flow->com->wq, &rel->work);
+   }
+}
+
+// Slot of a priority frame already delivered ahead of a hole
+static msg_t com_rel_delivered;
+
+/*
+  Return 1 if frame must be delivered now, 0 if it is kept for later or already seen
+  Priority frames are delivered as soon as they come
+*/
+static int
+com_rel_accept(com_flow_t *flow, msg_t *msg, u32 seq, int prio)
+{
+   com_rel_t *rel = &flow->rel;
+   u32 d = seq - rel->rx_cum;
+
+   if (d == 1) {
+      rel->rx_cum = seq;
+      return 1;
+   } else if (d == 0 || d > COM_REL_WINDOW || rel->ooo[seq % COM_REL_WINDOW]) {
+      return 0;
+   }
+
+   if (prio) {
+      rel->ooo[seq % COM_REL_WINDOW] = &com_rel_delivered;
+      return 1;
+   }
+   // Lost if memory is short, peer sends it again
+   rel->ooo[seq % COM_REL_WINDOW] = dup_msg(msg);
+   return 0;
+}
+
+/*
+  Next frame in order, if it was received ahead of time
+  com_rel_delivered if it was delivered already
+*/
+static msg_t*
+com_rel_next(com_rel_t *rel)
+{
+   u32 seq = rel->rx_cum + 1;
+   msg_t *m = rel->ooo[seq % COM_REL_WINDOW];
+
+   if (m) {
+      rel->ooo[seq % COM_REL_WINDOW] = NULL;
+      rel->rx_cum = seq;
+   }
+   return m;
+}
+
+static void
+com_rel_send_ack(com_flow_t *flow)
+{
+   com_t *com = flow->com;
+   com_rel_t *rel = &flow->rel;
+   wire_save_t save;
+   rel_ack_t a;
+   u32 sack = 0;
+   size_t len;
+   int i;
+
+   for (i=0; i<COM_REL_WINDOW - 1; i++) {
+      if (rel->ooo[(rel->rx_cum + 2 + i) % COM_REL_WINDOW]) {
+         sack |= BIT(i);
+      }
+   }
+   a.cum = cpu_to_le32(rel->rx_cum);
+   a.sack = cpu_to_le32(sack);
+
+   msg_set_data_size(rel->ack, 0);
+   msgcpy(rel->ack, &a, sizeof a);
+   len = msg_wire_encode(rel->ack, 0, 0, &save);
+   com->ops->send(com->state,flow->idx,save.frame,len,0);
+   msg_wire_restore(rel->ack, &save);
+}
+
+static void
+com_rel_reset_tx(com_flow_t *flow)
+{
+   com_rel_t *rel = &flow->rel;
+   unsigned long flags;
+   int i;
+
+   spin_lock_irqsave(&rel->lock, flags);
+   for (i=0; i<COM_REL_WINDOW; i++) {
+      kfree(rel->tx[i].frame);
+      rel->tx[i].frame = NULL;
+   }
+   rel->tx_acked = 0;
+   atomic_set(&flow->tx_seq, 0);
+   spin_unlock_irqrestore(&rel->lock, flags);
+}
+
+static void
+com_rel_reset_rx(com_rel_t *rel)
+{
+   int i;
+
+   for (i=0; i<COM_REL_WINDOW; i++) {
+      if (rel->ooo[i] && rel->ooo[i] != &com_rel_delivered) {
+         free_msg(rel->ooo[i]);
+      }
+      rel->ooo[i] = NULL;
+   }
+   rel->rx_cum = 0;
+}
+
+static int
+com_rel_init(com_flow_t *flow)
+{
+   com_rel_t *rel = &flow->rel;
+
+   spin_lock_init(&rel->lock);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,13,0)
+   hrtimer_init(&rel->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+   rel->timer.function = com_rel_timer;
+#else
+   hrtimer_setup(&rel->timer, com_rel_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#endif
+   INIT_WORK(&rel->work, com_rel_retransmit);
+
+   rel->ack = alloc_msg_management(sizeof(rel_ack_t));
+   if (!rel->ack) {
+      return -ENOMEM;
+   }
+   rel->ack->management_type = REL_ACK;
+
+   if (reliable && flow->com->ops->lossy) {
+      rel->scratch = kmalloc(MAX_SIZE_MSG + sizeof(msg_t) + sizeof(wire_hdr_t), GFP_KERNEL);
+      if (!rel->scratch) {
+         free_msg(rel->ack);
+         rel->ack = NULL;
+         return -ENOMEM;
+      }
+   }
+   return 0;
+}
+
+static void
+com_rel_stop(com_rel_t *rel)
+{
+   // Retransmission arms the timer again
+   hrtimer_cancel(&rel->timer);
+   cancel_work_sync(&rel->work);
+   hrtimer_cancel(&rel->timer);
+}
+
+static void
+com_rel_close(com_flow_t *flow)
+{
+   com_rel_t *rel = &flow->rel;
+
+   com_rel_stop(rel);
+   com_rel_reset_tx(flow);
+   com_rel_reset_rx(rel);
+   kfree(rel->scratch);
+   if (rel->ack) {
+      free_msg(rel->ack);
+   }
+}
+
+
+
+/*
+  LZ4 compression of bulk payloads
+  Payloads that do not shrink enough are sent as is
+*/
+#ifdef COM_LZ4
+static char*
+com_lz4_compress(com_flow_t *flow, const char *frame, size_t *len)
+{
+   size_t plen = *len - sizeof(wire_hdr_t);
+   size_t bound = LZ4_compressBound(plen);
+   wire_hdr_t *hdr;
+   char *out;
+   u64 start;
+   int clen;
+
+   if (!flow->lz4_wrk || plen < compress_min) {
+      return NULL;
+   }
+   out = kmalloc(sizeof(wire_hdr_t) + bound, GFP_KERNEL);
+   if (!out) {
+      return NULL;
+   }
+
+   start = bench_now();
+   mutex_lock(&flow->lz4_lock);
+   clen = LZ4_compress_default(frame + sizeof(wire_hdr_t), out + sizeof(wire_hdr_t), plen, bound, flow->lz4_wrk);
+   mutex_unlock(&flow->lz4_lock);
+
+   // Less than 1/16 saved is not worth decompressing
+   if (clen <= 0 || clen > plen - plen / 16) {
+      bench_compress(plen, 0, start);
+      kfree(out);
+      return NULL;
+   }
+   bench_compress(plen, clen, start);
+
+   memcpy(out, frame, sizeof(wire_hdr_t));
+   hdr = (wire_hdr_t *)out;
+   hdr->flags |= WIRE_F_LZ4;
+   hdr->len = cpu_to_le32(clen);
+   *len = sizeof(wire_hdr_t) + clen;
+   return out;
+}
+
+static int
+com_lz4_decompress(com_flow_t *flow, msg_t *msg)
+{
+   size_t plen = msg_get_data_size(msg);
+   u64 start = bench_now();
+   int n;
+
+   if (!flow->lz4_rx || !IS_USB_DATA(msg)) {
+      return -EINVAL;
+   }
+   n = LZ4_decompress_safe(msg->data, flow->lz4_rx, plen, msg->allocated_size);
+   if (n < 0) {
+      return -EINVAL;
+   }
+   memcpy(msg->data, flow->lz4_rx, n);
+   msg_set_data_size(msg, n);
+   bench_decompress(plen, n, start);
+   return 0;
+}
+
+static int
+com_lz4_init(com_flow_t *flow)
+{
+   mutex_init(&flow->lz4_lock);
+   flow->lz4_rx = kmalloc(MAX_SIZE_MSG, GFP_KERNEL);
+   if (!flow->lz4_rx) {
+      return -ENOMEM;
+   }
+   if (compress_bulk) {
+      flow->lz4_wrk = vmalloc(LZ4_MEM_COMPRESS);
+      if (!flow->lz4_wrk) {
+         kfree(flow->lz4_rx);
+         flow->lz4_rx = NULL;
+         return -ENOMEM;
+      }
+   }
+   return 0;
+}
+
+static void
+com_lz4_close(com_flow_t *flow)
+{
+   vfree(flow->lz4_wrk);
+   kfree(flow->lz4_rx);
+   flow->lz4_wrk = NULL;
+   flow->lz4_rx = NULL;
+}
+#else
+static char*
+com_lz4_compress(com_flow_t *flow, const char *frame, size_t *len)
+{
+   return NULL;
+}
+
+static int
+com_lz4_decompress(com_flow_t *flow, msg_t *msg)
+{
+   return -EINVAL;
+}
+
+static int
+com_lz4_init(com_flow_t *flow)
+{
+   if (compress_bulk) {
+      com_log(flow->com->id,WRN,"LZ4 not available, bulk payloads sent as is");
+   }
+   return 0;
+}
+
+static void
+com_lz4_close(com_flow_t *flow)
+{
+}
+#endif
+
+
+/*
+  Hand a received message to its consumer
+  Return 1 if it went up to the endpoints
+*/
+static int
+com_dispatch(com_flow_t *flow, msg_t *msg)
+{
+   com_t *com = flow->com;
+
+   if (!check_msg(msg)) {
       com_log(com->id,ERR,"Invalid structure of message");
-      return;
-   } else if (sz == 0) {
-      return;
+   } else if (IS_SET_VERSION_MNG_MSG(msg)) {
+      com_set_version(com, msg);
+   } else if (IS_REL_ACK_MNG_MSG(msg)) {
+      com_rel_acked(flow, msg);
    } else {
-      com->cb_recv(com->msg);
+      com->cb_recv(com, msg);
+      return 1;
    }
+   return 0;
 }
 
+/*
+  Read everything pending on the flow
+  Return the number of messages delivered
+*/
+static int
+com_deliver(com_flow_t *flow)
+{
+   com_t *com = flow->com;
+   msg_t *msg = flow->msg;
+   ssize_t sz;
+   int n = 0;
+
+   for (;;) {
+      int version = com->rx_version;
+      u8 flags = 0;
+      msg_t *m;
+
+      if (xchg(&flow->rel.rx_reset, 0)) {
+         com_rel_reset_rx(&flow->rel);
+      }
+
+      if (version == WIRE_V1) {
+         msg->tag = 0;
+         sz = com->ops->recv(com->state,flow->idx,(char *)&msg->size,msg->allocated_size);
+      } else {
+         sz = com->ops->recv(com->state,flow->idx,msg_wire_rx_buf(msg),msg->allocated_size + sizeof(wire_hdr_t) + WIRE_TAG_LEN);
+      }
+
+      // A bad frame is dropped by the backend, the next ones are still readable
+      if (sz == 0 || sz == -EAGAIN) {
+         return n;
+      } else if (sz < 0) {
+         com_log(com->id,ERR,"Unable to receive data from userland (err:%d)",sz);
+         continue;
+      }
+
+      if (version != WIRE_V1) {
+         if (msg_wire_decode(msg, sz, &flags, &flow->rx_seq) < 0) {
+            com_log(com->id,ERR,"Invalid v%d frame of %u bytes",version,sz);
+            continue;
+         }
+      } else if (msg->size != sz) {
+         com_log(com->id,ERR,"Wrong size msg %u but frame is %u bytes",msg->size,sz);
+         continue;
+      }
+
+      if ((flags & WIRE_F_LZ4) && com_lz4_decompress(flow, msg) < 0) {
+         com_log(com->id,ERR,"Unable to decompress payload of %u bytes",msg_get_data_size(msg));
+         continue;
+      }
+
+      if (!(flags & WIRE_F_REL)) {
+         n += com_dispatch(flow, msg);
+         continue;
+      }
+
+      // Frames ahead of a hole wait for it
+      if (com_rel_accept(flow, msg, flow->rx_seq, flags & WIRE_F_PRIO)) {
+         n += com_dispatch(flow, msg);
+         while ((m = com_rel_next(&flow->rel))) {
+            if (m != &com_rel_delivered) {
+               n += com_dispatch(flow, m);
+               free_msg(m);
+            }
+         }
+      }
+      com_rel_send_ack(flow);
+   }
+}
 
 /*
-  Called when a message arrives
+  Function executed by workqueue
 */
 static void
-wq_recv(com_t *com)
+com_recv(struct work_struct *data)
 {
-   recv_wq_t *work;
+   com_flow_t *flow = container_of(data, com_flow_t, work);
 
-   work = kmalloc(sizeof *work, GFP_KERNEL);
-   if(!work) {
-      com_log("COM",ERR,"Unable to allocate memory");
+   if (flow->poller) {
       return;
    }
-   work->com = com;
-   INIT_WORK(&work->work, &com_recv);
+   com_deliver(flow);
+}
 
-   queue_work(com->wq, (struct work_struct *)work);
+/*
+  Spin on the flow while data keeps coming, then back off up to sleeping
+  Sleep ends when the backend reports new data
+*/
+static int
+com_poll(void *data)
+{
+   com_flow_t *flow = (com_flow_t *)data;
+   unsigned int backoff = 0;
+   ktime_t last = ktime_get();
+
+   // A work may have started before the thread took over
+   flush_work(&flow->work);
+
+   while (!kthread_should_stop()) {
+      xchg(&flow->kick, 0);
+      if (com_deliver(flow)) {
+         last = ktime_get();
+         backoff = 0;
+         continue;
+      }
+
+      if (ktime_us_delta(ktime_get(), last) < busy_poll_usecs) {
+         cpu_relax();
+         cond_resched();
+      } else if (backoff < BUSY_POLL_MAX_BACKOFF_US) {
+         backoff = backoff ? backoff * 2 : 1;
+         usleep_range(backoff, backoff * 2);
+      } else {
+         set_current_state(TASK_INTERRUPTIBLE);
+         if (!READ_ONCE(flow->kick) && !kthread_should_stop()) {
+            schedule();
+         }
+         __set_current_state(TASK_RUNNING);
+      }
+   }
+   return 0;
 }
 
+static void
+com_start_pollers(com_t *com)
+{
+   int i;
+
+   for (i=0; i<min(busy_poll, com->nb_flows); i++) {
+      com_flow_t *flow = &com->flows[i];
+      struct task_struct *t;
+
+      t = kthread_create(com_poll, flow, "ubq_poll_%s/%d", com->id, i);
+      if (IS_ERR(t)) {
+         com_log(com->id,WRN,"Unable to start polling thread, flow %d stays on workqueue",i);
+         continue;
+      }
+      if (busy_poll_cpu >= 0 && com_cpu_valid(busy_poll_cpu + i)) {
+         kthread_bind(t, busy_poll_cpu + i);
+      }
+      com_thread_rt(t);
+      flow->poller = t;
+      wake_up_process(t);
+   }
+}
+
+static void
+com_stop_pollers(com_t *com)
+{
+   int i;
+
+   for (i=0; i<com->nb_flows; i++) {
+      struct task_struct *t = com->flows[i].poller;
+
+      if (t) {
+         WRITE_ONCE(com->flows[i].poller, NULL);
+         kthread_stop(t);
+      }
+   }
+}
+
+
+/*
+  Called when a message arrives, possibly in softirq context
+*/
+static void
+wq_recv(com_t *com, int idx)
+{
+   com_flow_t *flow = &com->flows[idx];
+
+   if (flow->poller) {
+      WRITE_ONCE(flow->kick, 1);
+      wake_up_process(flow->poller);
+      return;
+   }
+   queue_work_on(com_flow_cpu(flow), com->wq, &flow->work);
+}
+
+
+/*
+  Control and management on first flow, interrupt on second
+  Bulk and isochronous endpoints are spread on the others
+*/
+static int
+com_flow_of(const com_t *com, const msg_t *msg)
+{
+   int n = com->nb_flows;
+
+   if (n == 1 || IS_MANAGEMENT_MSG(msg)) {
+      return 0;
+   }
+   switch (msg->epid.type) {
+   case CTRL:
+      return 0;
+   case INTERRUPT:
+      return 1;
+   default:
+      return n > 2 ? 2 + msg->epid.num % (n - 2) : 1;
+   }
+}
+
+
+static com_class_t
+com_class_of(const msg_t *msg)
+{
+   if (IS_MANAGEMENT_MSG(msg)) {
+      return COM_CLASS_CTRL;
+   }
+   switch (msg->epid.type) {
+   case CTRL:
+      return COM_CLASS_CTRL;
+   case INTERRUPT:
+      return COM_CLASS_INT;
+   case ISOC:
+      return COM_CLASS_ISOC;
+   default:
+      return COM_CLASS_BULK;
+   }
+}
+
+
+/*
+  Frame on its way to the backend
+*/
+static int
+com_xmit(com_flow_t *flow, char *frame, size_t len, int more)
+{
+   com_t *com = flow->com;
+
+   if (com_rel_enabled(com)) {
+      return com_rel_send(flow, frame, len, more);
+   }
+   return com->ops->send(com->state,flow->idx,frame,len,more);
+}
+
+/*
+  Transmit scheduler
+  Senders push a copy of the frame on a lock-free list, one thread per channel
+  sorts frames in the queue of their class and sends them
+  Deficit round robin: each turn a class may send tx_weights times a quantum
+  of bytes, higher classes first
+*/
+typedef struct com_tx_t {
+   struct llist_node node;
+   struct list_head list;
+   com_flow_t *flow;
+   com_class_t cls;
+   size_t len;
+   int more;
+   char frame[0];
+} com_tx_t;
+
+static int
+com_tx_weight(com_class_t cls)
+{
+   return max(tx_weights[cls], 1);
+}
+
+// Transmit thread only, something pending
+static com_tx_t*
+com_tx_pick(com_t *com)
+{
+   for (;;) {
+      int c = com->tx_cur;
+      com_tx_t *tx = list_first_entry_or_null(&com->txq[c], com_tx_t, list);
+
+      if (!tx) {
+         com->tx_deficit[c] = 0;
+      } else if (tx->len <= com->tx_deficit[c]) {
+         com->tx_deficit[c] -= tx->len;
+         list_del(&tx->list);
+         com->tx_pending--;
+         return tx;
+      }
+
+      // Turn of next class
+      com->tx_cur = (c + 1) % COM_NB_CLASSES;
+      com->tx_deficit[com->tx_cur] += COM_TX_QUANTUM * com_tx_weight(com->tx_cur);
+   }
+}
+
+/*
+  Move what senders pushed to class queues, in order
+*/
+static void
+com_tx_collect(com_t *com)
+{
+   struct llist_node *first;
+   com_tx_t *tx, *tmp;
+
+   first = llist_reverse_order(llist_del_all(&com->tx_in));
+   llist_for_each_entry_safe(tx, tmp, first, node) {
+      list_add_tail(&tx->list, &com->txq[tx->cls]);
+      com->tx_pending++;
+   }
+}
+
+static int
+com_tx_thread(void *data)
+{
+   com_t *com = (com_t *)data;
+   int bound = -1;
+
+   while (!kthread_should_stop()) {
+      com_tx_t *tx;
+      int cpu = READ_ONCE(tx_cpu);
+      int err;
+
+      if (cpu != bound) {
+         set_cpus_allowed_ptr(current, com_cpu_valid(cpu) ? cpumask_of(cpu) : cpu_possible_mask);
+         bound = cpu;
+      }
+
+      // New frames are collected before each pick, so urgent ones are not late
+      com_tx_collect(com);
+      if (!com->tx_pending) {
+         wait_event_interruptible(com->tx_wait, !llist_empty(&com->tx_in) || kthread_should_stop());
+         continue;
+      }
+
+      tx = com_tx_pick(com);
+      atomic_dec(&com->txq_len[tx->cls]);
+      err = com_xmit(tx->flow, tx->frame, tx->len, tx->more);
+      if (err < 0) {
+         com_log(com->id,ERR,"Unable to send queued frame [%d]",err);
+      }
+      kfree(tx);
+      cond_resched();
+   }
+   return 0;
+}
+
+static int
+com_tx_queue(com_flow_t *flow, com_class_t cls, const char *frame, size_t len, int more)
+{
+   com_t *com = flow->com;
+   com_tx_t *tx;
+
+   if (atomic_inc_return(&com->txq_len[cls]) > tx_queue_max) {
+      atomic_dec(&com->txq_len[cls]);
+      com_log(com->id,WRN,"Transmit queue of class %d is full",cls);
+      return -ENOBUFS;
+   }
+
+   tx = kmalloc(sizeof *tx + len, GFP_ATOMIC);
+   if (!tx) {
+      atomic_dec(&com->txq_len[cls]);
+      com_log(com->id,ERR,"Unable to allocate memory");
+      return -ENOMEM;
+   }
+   tx->flow = flow;
+   tx->cls = cls;
+   tx->len = len;
+   tx->more = more;
+   memcpy(tx->frame, frame, len);
+
+   // Thread only sleeps once list is empty
+   if (llist_add(&tx->node, &com->tx_in)) {
+      wake_up(&com->tx_wait);
+   }
+   return len;
+}
+
+static int
+com_tx_init(com_t *com)
+{
+   int i;
+
+   init_llist_head(&com->tx_in);
+   init_waitqueue_head(&com->tx_wait);
+   for (i=0; i<COM_NB_CLASSES; i++) {
+      INIT_LIST_HEAD(&com->txq[i]);
+      atomic_set(&com->txq_len[i], 0);
+      com->tx_deficit[i] = 0;
+   }
+   com->tx_cur = COM_CLASS_CTRL;
+   com->tx_pending = 0;
+   com->tx_thread = NULL;
+
+   if (!tx_sched) {
+      return 0;
+   }
+   com->tx_thread = kthread_run(com_tx_thread, com, "ubq_tx_%s", com->id);
+   if (IS_ERR(com->tx_thread)) {
+      com->tx_thread = NULL;
+      return -ENOMEM;
+   }
+   com_thread_rt(com->tx_thread);
+   return 0;
+}
+
+static void
+com_tx_close(com_t *com)
+{
+   com_tx_t *tx, *tmp;
+   int i;
+
+   if (com->tx_thread) {
+      kthread_stop(com->tx_thread);
+      com->tx_thread = NULL;
+   }
+
+   com_tx_collect(com);
+   for (i=0; i<COM_NB_CLASSES; i++) {
+      list_for_each_entry_safe(tx, tmp, &com->txq[i], list) {
+         list_del(&tx->list);
+         kfree(tx);
+      }
+   }
+   com->tx_pending = 0;
+}
+
+/*
+  Return 1 if com_send never sleeps for msg
+  Frame is then only copied for the transmit thread
+*/
+/*
+  Return 1 if DATA sent to userland can carry a verdict tag
+*/
+int
+com_tagged(const com_t *com)
+{
+   return com->tx_version != WIRE_V1;
+}
+
+int
+com_send_atomic(const com_t *com, const msg_t *msg)
+{
+   return com->tx_thread && !(compress_bulk && IS_USB_DATA(msg) && msg->epid.type == BULK);
+}
 
 int
 com_send(com_t *com,msg_t *msg)
 {
+   com_flow_t *flow;
+   com_class_t cls;
+   wire_save_t save;
+   char *frame;
+   char *lz4 = NULL;
+   size_t len;
+   int more;
+   int rel;
+   int ret;
+
    if (!check_msg(msg)) {
       com_log(com->id,ERR,"Invalid structure of message, not sending");
       return -EINVAL;
    }
-   return conf_com.send(com->state,msg);
+   flow = &com->flows[com_flow_of(com,msg)];
+   cls = com_class_of(msg);
+
+   // Bulk data may be batched by backend
+   more = IS_USB_DATA(msg) && msg->epid.type == BULK;
+
+   if (com->tx_version == WIRE_V1) {
+      if (tx_sched) {
+         return com_tx_queue(flow, cls, (char *)&msg->size, msg->size, more);
+      }
+      return com->ops->send(com->state,flow->idx,(char *)&msg->size,msg->size,more);
+   }
+
+   // Reliable frames get their sequence once sure to be kept
+   rel = com_rel_enabled(com);
+   len = msg_wire_encode(msg, cls != COM_CLASS_BULK && cls != COM_CLASS_ISOC ? WIRE_F_PRIO : 0,
+                         rel ? 0 : atomic_inc_return(&flow->tx_seq), &save);
+   frame = save.frame;
+
+   // Header may have overwritten msg type, more tells it is bulk DATA
+   // Tagged payloads are sent as is, userland reads the tag in clear
+   if (more && compress_bulk && save.hdr_len == sizeof(wire_hdr_t)) {
+      lz4 = com_lz4_compress(flow, frame, &len);
+      if (lz4) {
+         frame = lz4;
+      }
+   }
+
+   if (tx_sched) {
+      ret = com_tx_queue(flow, cls, frame, len, more);
+   } else {
+      ret = com_xmit(flow, frame, len, more);
+   }
+   kfree(lz4);
+   msg_wire_restore(msg, &save);
+   return ret;
+}
+
+
+size_t
+com_frame_len(const com_t *com, const char *buf)
+{
+   return msg_frame_len(com->rx_version, buf);
+}
+
+
+/*
+  Userland asks for a wire format, at session start
+  Answer is sent with previous format, next messages use the new one
+*/
+static void
+com_set_version(com_t *com, msg_t *msg)
+{
+   __le32 v = 0;
+   u32 version;
+   msg_t *ack;
+   int i;
+
+   if (msg_get_data_size(msg) >= sizeof v) {
+      memcpy(&v, msg->management_data, sizeof v);
+   }
+   version = clamp_t(u32, le32_to_cpu(v), WIRE_V1, WIRE_V2);
+
+   ack = alloc_msg_management(sizeof v);
+   if (!ack) {
+      com_log(com->id,ERR,"Unable to allocate memory");
+      return;
+   }
+   ack->management_type = SET_VERSION;
+   v = cpu_to_le32(version);
+   msgcpy(ack, &v, sizeof v);
+
+   com_log(com->id,INFO,"Switch to wire format v%u",version);
+   com->rx_version = version;
+   com_send(com, ack);
+   // New session, sequences start over
+   for (i=0; i<com->nb_flows; i++) {
+      com_rel_reset_tx(&com->flows[i]);
+      WRITE_ONCE(com->flows[i].rel.rx_reset, 1);
+   }
+   com->tx_version = version;
+   free_msg(ack);
 }
 
 
 
 /*
   Init communication
+  Return an ERR_PTR on failure
  */
 com_t*
-com_init(void *opt, int (cb_recv)(msg_t*), const char *name)
+com_init(void *opt, int (cb_recv)(com_t*, msg_t*), const char *name, void *priv)
 {
+   com_opt_t *o = (com_opt_t *)opt;
    com_t *com;
+   int err = -ENOMEM;
+   int i;
 
-   com = kmalloc(sizeof *com, GFP_KERNEL);
+   com = kzalloc(sizeof *com, GFP_KERNEL);
    if (!com) {
       goto fail1;
    }
 
-   com->msg = alloc_msg(MAX_SIZE_MSG,DATA);
-   if (!com->msg) {
-      goto fail2;
+   com->cb_recv = cb_recv;
+   com->priv = priv;
+   strncpy(com->id,name,MAX_SIZE_ID);
+   com->ops = find_backend(transport);
+   com->nb_flows = clamp(flows, 1, com->ops->max_flows);
+   com->rx_version = WIRE_V1;
+   com->tx_version = WIRE_V1;
+
+   for (i=0; i<com->nb_flows; i++) {
+      com_flow_t *flow = &com->flows[i];
+
+      flow->com = com;
+      flow->idx = i;
+      flow->cpu = com->nb_flows > 1 || o->instance > 0 ? cpumask_local_spread(o->instance * com->nb_flows + i, NUMA_NO_NODE) : WORK_CPU_UNBOUND;
+      INIT_WORK(&flow->work, &com_recv);
+      // Room for the tag of a full DATA payload, see msg_wire_decode
+      flow->msg = alloc_msg(MAX_SIZE_MSG + WIRE_TAG_LEN,DATA);
+      if (!flow->msg) {
+         goto fail2;
+      }
+      flow->msg->allocated_size = MAX_SIZE_MSG;
+      if (com_rel_init(flow) < 0) {
+         goto fail2;
+      }
+      if (com_lz4_init(flow) < 0) {
+         goto fail2;
+      }
    }
 
-   com->cb_recv = cb_recv;
+   // Backend may report data as soon as it is initialised
+   com->wq = create_workqueue("recv");
+   if (!com->wq) {
+      goto fail2;
+   }
 
-   com->state = conf_com.init(com,opt,wq_recv);
-   if (com->state < 0) {
+   com->state = com->ops->init(com,opt,wq_recv);
+   if (IS_ERR(com->state)) {
+      err = PTR_ERR(com->state);
       goto fail3;
    }
 
-   strncpy(com->id,name,MAX_SIZE_ID);
-   com->send = com_send;
+   err = com_tx_init(com);
+   if (err < 0) {
+      com_log(name,ERR,"Unable to start transmit thread");
+      goto fail4;
+   }
 
-   com->wq = create_workqueue("recv");
+   com->send = com_send;
+   com_start_pollers(com);
 
    return com;
 
+ fail4:
+   com->ops->close(com->state);
  fail3:
-   free_msg(com->msg);
+   destroy_workqueue(com->wq);
  fail2:
+   for (i=0; i<com->nb_flows; i++) {
+      if (com->flows[i].msg) {
+         free_msg(com->flows[i].msg);
+      }
+      if (com->flows[i].rel.ack) {
+         com_rel_close(&com->flows[i]);
+      }
+      com_lz4_close(&com->flows[i]);
+   }
    kfree(com);
  fail1:
-   com_log(com->id,ERR,"Unable to allocate memory");
-   return NULL;
+   com_log(name,ERR,"Unable to initialise communication [%d]",err);
+   return ERR_PTR(err);
 }
 
 
 void
 com_close(com_t *com)
 {
+   int i;
+
+   com_stop_pollers(com);
+   com_tx_close(com);
+   for (i=0; i<com->nb_flows; i++) {
+      com_rel_stop(&com->flows[i].rel);
+   }
    flush_workqueue(com->wq);
    destroy_workqueue(com->wq);
-   conf_com.close(com->state);
-   free_msg(com->msg);
+   com->ops->close(com->state);
+   for (i=0; i<com->nb_flows; i++) {
+      com_rel_close(&com->flows[i]);
+      com_lz4_close(&com->flows[i]);
+      free_msg(com->flows[i].msg);
+   }
    kfree(com);
 }
@@ -3,10 +3,30 @@
 
 #include <linux/kernel.h>
 #include <linux/workqueue.h>
+#include <linux/atomic.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/hrtimer.h>
+#include <linux/llist.h>
+#include <linux/wait.h>
 
 #include "msg.h"
 
 #define MAX_SIZE_ID 64 // Because 64 is good
+#define MAX_SIZE_MSG 16000
+#define COM_MAX_FLOWS 4
+#define COM_MAX_INSTANCES 4 // Channels of the same side
+#define COM_INSTANCE_PORTS (2*COM_MAX_FLOWS) // Port step between channels of the same side
+#define COM_REL_WINDOW 32 // Frames in flight per flow, fits in sack bitmap
+
+// Transmit classes, by decreasing priority
+typedef enum com_class_t {
+   COM_CLASS_CTRL,   // Control and management
+   COM_CLASS_INT,
+   COM_CLASS_ISOC,
+   COM_CLASS_BULK,
+   COM_NB_CLASSES
+} com_class_t;
 
 #ifndef CONFIG_COM_DEBUG_LEVEL
 #define CONFIG_COM_DEBUG_LEVEL DBG
@@ -14,14 +34,97 @@
 
 #define CONFIG_COM_DEBUG
 
+struct internal_com_t;
+struct com_t;
+
+typedef enum com_channel_t {
+   GADGET_CHANNEL,
+   DRIVER_CHANNEL,
+   NB_CHANNELS
+} com_channel_t;
+
+/*
+  Options given to communication backend
+  Each backend only uses what it needs
+*/
+typedef struct com_opt_t {
+   com_channel_t channel;
+   unsigned short port;
+   __be32 addr;
+   int connect;
+   int instance; // Channels of the same side (< COM_MAX_INSTANCES), flows spread on CPUs accordingly
+} com_opt_t;
+
+// Frame kept until peer acknowledges it
+typedef struct com_rel_tx_t {
+   u32 seq;
+   size_t len;
+   ktime_t sent;
+   int retries;
+   char *frame; // NULL when slot is free
+} com_rel_tx_t;
+
+/*
+  Reliable delivery, v2 on lossy backends
+  Sequence numbers start at 1, acknowledged ones are released from tx
+  Received frames ahead of a hole wait in ooo
+*/
+typedef struct com_rel_t {
+   spinlock_t lock;
+   com_rel_tx_t tx[COM_REL_WINDOW];
+   u32 tx_acked;  // Every sequence up to it acknowledged by peer
+   struct hrtimer timer;
+   struct work_struct work; // Retransmission
+   char *scratch; // Frame being retransmitted
+   u32 rx_cum;    // Every sequence up to it delivered
+   int rx_reset;
+   msg_t *ooo[COM_REL_WINDOW];
+   msg_t *ack;
+} com_rel_t;
+
+/*
+  A flow carries one class of traffic
+  Each flow is read by its own work, on its own CPU
+*/
+typedef struct com_flow_t {
+   struct com_t *com;
+   int idx;
+   int cpu;
+   msg_t *msg;
+   struct work_struct work;
+   struct task_struct *poller; // Busy-polling thread, replaces the work when set
+   int kick;
+   atomic_t tx_seq;
+   u32 rx_seq;   // Last sequence number received (v2)
+   com_rel_t rel;
+   struct mutex lz4_lock; // Compressed sends never run in atomic context, see com_send_atomic
+   void *lz4_wrk; // Compression state, NULL if payloads are sent as is
+   char *lz4_rx;  // Decompressed payload
+} com_flow_t;
+
 typedef struct com_t {
    int (*send)(struct com_t *,msg_t *);
-   int (*cb_recv)(msg_t *);
-   msg_t *msg;
+   int (*cb_recv)(struct com_t *,msg_t *);
+   void *priv; // Given by channel owner
    struct task_struct *thread;
    char id[MAX_SIZE_ID];
    struct workqueue_struct *wq;
+   struct internal_com_t *ops; // Choosen communication backend
    void *state; // Specific data for choosen communication
+   int nb_flows;
+   com_flow_t flows[COM_MAX_FLOWS];
+   int rx_version; // Wire format, see msg.h
+   int tx_version;
+   // Transmit scheduler
+   struct llist_head tx_in;   // Pushed by senders without lock
+   struct task_struct *tx_thread;
+   wait_queue_head_t tx_wait;
+   atomic_t txq_len[COM_NB_CLASSES]; // Frames not sent yet per class
+   // Owned by transmit thread
+   struct list_head txq[COM_NB_CLASSES];
+   int tx_deficit[COM_NB_CLASSES];
+   int tx_cur;
+   int tx_pending;
 } com_t;
 
 #ifdef CONFIG_COM_DEBUG
@@ -36,13 +139,34 @@ typedef struct com_t {
 #define slog(thestate,lvl,buf,fmt,args...) {}
 #endif
 
-typedef void* (*com_init_fn)(com_t *com, void *opt, void (cb_recv)(com_t*));
+/*
+  Backends get the flow index on send/recv, and give it back on new data
+  They move whole frames, com_frame_len gives the length of a frame from its
+  first WIRE_MIN_HDR bytes
+  recv returns the frame length, 0 once nothing is left to read on the flow
+*/
+// Return backend state, or an ERR_PTR
+typedef void* (*com_init_fn)(com_t *com, void *opt, void (cb_recv)(com_t*, int));
 typedef void (*com_close_fn)(void *state);
-typedef int (*com_send_fn)(void *,msg_t *);
-typedef int (*com_recv_fn)(void *,msg_t *);
+typedef int (*com_send_fn)(void *,int,const char *,size_t,int); // Last argument: frame may wait for next ones
+typedef int (*com_recv_fn)(void *,int,char *,size_t);
+
+typedef struct internal_com_t {
+   const char *name;
+   int max_flows;
+   int lossy;    // Frames may be lost, reliable delivery applies
+   com_init_fn init;
+   com_close_fn close;
+   com_send_fn send;
+   com_recv_fn recv;
+} internal_com_t;
 
 
-com_t* com_init(void *, int (cb_recv)(msg_t*), const char *name);
+com_t* com_init(void *, int (cb_recv)(com_t*, msg_t*), const char *name, void *priv);
 void com_close(com_t *);
+size_t com_frame_len(const com_t *com, const char *buf);
+int com_send_atomic(const com_t *com, const msg_t *msg);
+int com_tagged(const com_t *com);
+void com_rx_thread_setup(struct task_struct *t);
 
 #endif
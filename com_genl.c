@@ -0,0 +1,396 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/version.h>
+#include <linux/capability.h>
+#include <net/genetlink.h>
+
+#include "msg.h"
+#include "com.h"
+#include "com_genl.h"
+#include "debug.h"
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+
+typedef struct genl_rx_t {
+   struct list_head list;
+   size_t len;
+   char data[0];
+} genl_rx_t;
+
+/*
+  Relayed traffic is as sensitive as the USB device itself: sending needs
+  CAP_NET_ADMIN, and so does joining a group, checked by genetlink from 6.7
+  and by mcast_bind before 5.10. Kernels in between cannot restrict groups,
+  the transport is refused there.
+*/
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,7,0)
+#define GENL_MCAST_FLAGS GENL_MCAST_CAP_NET_ADMIN
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(5,10,0)
+#define GENL_MCAST_BIND
+#else
+#define GENL_MCAST_OPEN
+#endif
+
+static genl_state_t *genl_states[NB_CHANNELS][COM_MAX_INSTANCES];
+static DEFINE_MUTEX(genl_lock);
+static int genl_users = 0;
+
+static int genl_com_doit(struct sk_buff *skb, struct genl_info *info);
+
+static const struct nla_policy ubq_genl_policy[UBQ_GENL_ATTR_MAX + 1] = {
+   [UBQ_GENL_ATTR_CHANNEL] = { .type = NLA_U8 },
+   [UBQ_GENL_ATTR_MSG] = { .type = NLA_BINARY },
+   [UBQ_GENL_ATTR_INSTANCE] = { .type = NLA_U8 },
+};
+
+static const struct genl_ops ubq_genl_ops[] = {
+   {
+      .cmd = UBQ_GENL_CMD_MSG,
+      .doit = genl_com_doit,
+      .flags = GENL_ADMIN_PERM,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,2,0)
+      .policy = ubq_genl_policy,
+#else
+      .validate = GENL_DONT_VALIDATE_STRICT | GENL_DONT_VALIDATE_DUMP,
+#endif
+   },
+};
+
+// Group index is the channel
+static const struct genl_multicast_group ubq_genl_groups[NB_CHANNELS] = {
+#ifdef GENL_MCAST_FLAGS
+   [GADGET_CHANNEL] = { .name = UBQ_GENL_GROUP_GADGET, .flags = GENL_MCAST_FLAGS },
+   [DRIVER_CHANNEL] = { .name = UBQ_GENL_GROUP_DRIVER, .flags = GENL_MCAST_FLAGS },
+#else
+   [GADGET_CHANNEL] = { .name = UBQ_GENL_GROUP_GADGET },
+   [DRIVER_CHANNEL] = { .name = UBQ_GENL_GROUP_DRIVER },
+#endif
+};
+
+#ifdef GENL_MCAST_BIND
+// Called in the context of the process joining a group
+static int
+genl_mcast_bind(struct net *net, int group)
+{
+   return capable(CAP_NET_ADMIN) ? 0 : -EPERM;
+}
+#endif
+
+static struct genl_family ubq_genl_family = {
+   .name = UBQ_GENL_NAME,
+   .version = UBQ_GENL_VERSION,
+   .maxattr = UBQ_GENL_ATTR_MAX,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,2,0)
+   .policy = ubq_genl_policy,
+#endif
+   .module = THIS_MODULE,
+   .ops = ubq_genl_ops,
+   .n_ops = ARRAY_SIZE(ubq_genl_ops),
+   .mcgrps = ubq_genl_groups,
+   .n_mcgrps = ARRAY_SIZE(ubq_genl_groups),
+#ifdef GENL_MCAST_BIND
+   .mcast_bind = genl_mcast_bind,
+#endif
+};
+
+
+/*
+  Called in the context of the userland sender
+  Every message of the batch is queued, then read through com_recv
+*/
+static int
+genl_com_doit(struct sk_buff *skb, struct genl_info *info)
+{
+   genl_state_t *state;
+   struct nlattr *nla;
+   int rem;
+   int channel;
+   int instance = 0;
+
+   if (!info->attrs[UBQ_GENL_ATTR_CHANNEL]) {
+      return -EINVAL;
+   }
+   channel = nla_get_u8(info->attrs[UBQ_GENL_ATTR_CHANNEL]);
+   if (channel >= NB_CHANNELS) {
+      return -EINVAL;
+   }
+   if (info->attrs[UBQ_GENL_ATTR_INSTANCE]) {
+      instance = nla_get_u8(info->attrs[UBQ_GENL_ATTR_INSTANCE]);
+      if (instance >= COM_MAX_INSTANCES) {
+         return -EINVAL;
+      }
+   }
+
+   mutex_lock(&genl_lock);
+   state = genl_states[channel][instance];
+   if (!state) {
+      mutex_unlock(&genl_lock);
+      return -ENODEV;
+   }
+
+   nlmsg_for_each_attr(nla, info->nlhdr, GENL_HDRLEN, rem) {
+      genl_rx_t *rx;
+      unsigned long flags;
+
+      if (nla_type(nla) != UBQ_GENL_ATTR_MSG) {
+         continue;
+      }
+
+      rx = kmalloc(sizeof *rx + nla_len(nla), GFP_KERNEL);
+      if (!rx) {
+         slog(state,ERR,"Unable to allocate memory");
+         break;
+      }
+      rx->len = nla_len(nla);
+      memcpy(rx->data, nla_data(nla), rx->len);
+
+      spin_lock_irqsave(&state->rx_lock,flags);
+      list_add_tail(&rx->list,&state->rx);
+      spin_unlock_irqrestore(&state->rx_lock,flags);
+
+      state->cb(state->com, 0);
+   }
+   mutex_unlock(&genl_lock);
+
+   return 0;
+}
+
+/*
+  Send current batch, tx_lock held
+*/
+static void
+genl_flush(genl_state_t *state)
+{
+   struct sk_buff *skb = state->tx;
+   int err;
+
+   if (!skb) {
+      return;
+   }
+   state->tx = NULL;
+
+   genlmsg_end(skb, state->tx_hdr);
+   err = genlmsg_multicast(&ubq_genl_family, skb, 0, state->channel, GFP_KERNEL);
+   if (err < 0 && err != -ESRCH) {
+      slog(state,ERR,"Unable to multicast batch [%d]",err);
+   }
+}
+
+static void
+genl_tx_work(struct work_struct *work)
+{
+   genl_state_t *state = container_of(work, genl_state_t, tx_work);
+
+   mutex_lock(&state->tx_lock);
+   genl_flush(state);
+   mutex_unlock(&state->tx_lock);
+}
+
+static int
+genl_send(genl_state_t *state, const char *buf, size_t len)
+{
+   int err = 0;
+
+   mutex_lock(&state->tx_lock);
+
+   if (state->tx && skb_tailroom(state->tx) < nla_total_size(len)) {
+      genl_flush(state);
+   }
+
+   if (!state->tx) {
+      struct sk_buff *skb;
+
+      skb = genlmsg_new(max_t(size_t, NLMSG_GOODSIZE, nla_total_size(len) + 2*nla_total_size(sizeof(u8))), GFP_KERNEL);
+      if (!skb) {
+         slog(state,ERR,"Unable to allocate skb");
+         err = -ENOMEM;
+         goto end;
+      }
+      state->tx_hdr = genlmsg_put(skb, 0, 0, &ubq_genl_family, 0, UBQ_GENL_CMD_MSG);
+      if (!state->tx_hdr || nla_put_u8(skb, UBQ_GENL_ATTR_CHANNEL, state->channel) ||
+          nla_put_u8(skb, UBQ_GENL_ATTR_INSTANCE, state->instance)) {
+         nlmsg_free(skb);
+         err = -EMSGSIZE;
+         goto end;
+      }
+      state->tx = skb;
+   }
+
+   err = nla_put(state->tx, UBQ_GENL_ATTR_MSG, len, buf);
+   if (err < 0) {
+      slog(state,ERR,"Unable to add msg to batch [%d]",err);
+      goto end;
+   }
+
+   // Batch is sent as soon as the workqueue runs, collecting what was queued meanwhile
+   queue_work(system_highpri_wq, &state->tx_work);
+
+ end:
+   mutex_unlock(&state->tx_lock);
+   return err < 0 ? err : len;
+}
+
+int
+genl_com_send(void *state, int flow, const char *buf, size_t len, int more)
+{
+   return genl_send((genl_state_t*)state,buf,len);
+}
+
+static int
+genl_recv(genl_state_t *state, char *buf, size_t maxlen)
+{
+   genl_rx_t *rx;
+   unsigned long flags;
+   size_t len;
+
+   spin_lock_irqsave(&state->rx_lock,flags);
+   rx = list_first_entry_or_null(&state->rx, genl_rx_t, list);
+   if (rx) {
+      list_del(&rx->list);
+   }
+   spin_unlock_irqrestore(&state->rx_lock,flags);
+
+   if (!rx) {
+      return 0;
+   }
+
+   len = rx->len;
+   if (len < WIRE_MIN_HDR || len > maxlen) {
+      slog(state,ERR,"Netlink msg of bad size %u (buffer_sz:%u)",len,maxlen);
+      kfree(rx);
+      return -EINVAL;
+   }
+   memcpy(buf, rx->data, len);
+   kfree(rx);
+
+   return len;
+}
+
+int
+genl_com_recv(void *state, int flow, char *buf, size_t maxlen)
+{
+   return genl_recv((genl_state_t*)state,buf,maxlen);
+}
+
+void*
+genl_com_init(com_t *com, void *opt, void (cb_recv)(com_t*, int))
+{
+   genl_state_t *state;
+   com_opt_t *o = (com_opt_t *)opt;
+   int first;
+   int err;
+
+   if (o->channel >= NB_CHANNELS || o->instance < 0 || o->instance >= COM_MAX_INSTANCES) {
+      return ERR_PTR(-EINVAL);
+   }
+
+#ifdef GENL_MCAST_OPEN
+   com_log("GENL",ERR,"Kernel cannot restrict multicast groups to CAP_NET_ADMIN, netlink transport refused");
+   return ERR_PTR(-EPERM);
+#endif
+
+   state = kzalloc(sizeof *state, GFP_KERNEL);
+   if (!state) {
+      com_log("GENL",ERR,"Unable to allocate memory");
+      return ERR_PTR(-ENOMEM);
+   }
+
+   state->channel = o->channel;
+   state->instance = o->instance;
+   state->cb = cb_recv;
+   state->com = com;
+   spin_lock_init(&state->rx_lock);
+   INIT_LIST_HEAD(&state->rx);
+   mutex_init(&state->tx_lock);
+   state->tx = NULL;
+   INIT_WORK(&state->tx_work, genl_tx_work);
+
+   mutex_lock(&genl_lock);
+   if (genl_states[state->channel][state->instance]) {
+      mutex_unlock(&genl_lock);
+      com_log("GENL",ERR,"Channel %u instance %d already used",state->channel,state->instance);
+      kfree(state);
+      return ERR_PTR(-EBUSY);
+   }
+   first = (genl_users++ == 0);
+   mutex_unlock(&genl_lock);
+
+   // Family (un)registration is done without genl_lock, doit takes it under genetlink own lock
+   if (first) {
+      err = genl_register_family(&ubq_genl_family);
+      if (err < 0) {
+         com_log("GENL",ERR,"Unable to register generic netlink family [%d]",err);
+         mutex_lock(&genl_lock);
+         genl_users--;
+         mutex_unlock(&genl_lock);
+         kfree(state);
+         return ERR_PTR(err);
+      }
+   }
+
+   mutex_lock(&genl_lock);
+   genl_states[state->channel][state->instance] = state;
+   mutex_unlock(&genl_lock);
+
+   return (void *)state;
+}
+
+void
+genl_com_close(void *state)
+{
+   genl_state_t *s = (genl_state_t *)state;
+   genl_rx_t *rx, *tmp;
+   int last;
+
+   mutex_lock(&genl_lock);
+   genl_states[s->channel][s->instance] = NULL;
+   last = (--genl_users == 0);
+   mutex_unlock(&genl_lock);
+
+   if (last) {
+      genl_unregister_family(&ubq_genl_family);
+   }
+
+   cancel_work_sync(&s->tx_work);
+   mutex_lock(&s->tx_lock);
+   if (s->tx) {
+      nlmsg_free(s->tx);
+      s->tx = NULL;
+   }
+   mutex_unlock(&s->tx_lock);
+
+   list_for_each_entry_safe(rx, tmp, &s->rx, list) {
+      list_del(&rx->list);
+      kfree(rx);
+   }
+   kfree(s);
+}
+
+#else
+
+void*
+genl_com_init(com_t *com, void *opt, void (cb_recv)(com_t*, int))
+{
+   com_log("GENL",ERR,"Netlink transport needs a 4.10 kernel at least");
+   return ERR_PTR(-EOPNOTSUPP);
+}
+
+void
+genl_com_close(void *state)
+{
+}
+
+int
+genl_com_send(void *state, int flow, const char *buf, size_t len, int more)
+{
+   return -EINVAL;
+}
+
+int
+genl_com_recv(void *state, int flow, char *buf, size_t maxlen)
+{
+   return -EINVAL;
+}
+
+#endif
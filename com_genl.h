@@ -0,0 +1,56 @@
+#ifndef __COMM_GENL_H
+#define __COMM_GENL_H
+
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include "com.h"
+
+/*
+  Generic netlink family shared with userland
+  Kernel -> userland: UBQ_GENL_CMD_MSG multicast on the channel group
+  Userland -> kernel: UBQ_GENL_CMD_MSG with UBQ_GENL_ATTR_CHANNEL
+  Both ways UBQ_GENL_ATTR_INSTANCE tells the device of the channel (0 if absent)
+  Each message may carry several UBQ_GENL_ATTR_MSG attributes, one per msg_t
+*/
+#define UBQ_GENL_NAME "ubq_core"
+#define UBQ_GENL_VERSION 1
+#define UBQ_GENL_GROUP_GADGET "gadget"
+#define UBQ_GENL_GROUP_DRIVER "driver"
+
+enum {
+   UBQ_GENL_ATTR_UNSPEC,
+   UBQ_GENL_ATTR_CHANNEL, // u8, com_channel_t
+   UBQ_GENL_ATTR_MSG,     // binary, msg_t starting at size field
+   UBQ_GENL_ATTR_INSTANCE, // u8, com_opt_t instance
+   __UBQ_GENL_ATTR_MAX
+};
+#define UBQ_GENL_ATTR_MAX (__UBQ_GENL_ATTR_MAX - 1)
+
+enum {
+   UBQ_GENL_CMD_UNSPEC,
+   UBQ_GENL_CMD_MSG,
+   __UBQ_GENL_CMD_MAX
+};
+
+typedef struct genl_state_t {
+   com_channel_t channel;
+   int instance;
+   void (*cb)(com_t *, int); // Called when a new message is coming
+   com_t *com;
+   spinlock_t rx_lock;
+   struct list_head rx;     // Messages received, not yet read
+   struct mutex tx_lock;
+   struct sk_buff *tx;      // Batch being filled
+   void *tx_hdr;
+   struct work_struct tx_work;
+} genl_state_t;
+
+
+/* API */
+void* genl_com_init(com_t *com, void *opt, void (cb_recv)(com_t*, int));
+void genl_com_close(void *state);
+int genl_com_send(void *state, int flow, const char *buf, size_t len, int more);
+int genl_com_recv(void *state, int flow, char *buf, size_t maxlen);
+
+#endif
@@ -0,0 +1,350 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/kthread.h>
+#include <linux/delay.h>
+#include <linux/net.h>
+#include <net/sock.h>
+
+#include "msg.h"
+#include "com.h"
+#include "com_stream.h"
+#include "debug.h"
+
+#define STREAM_RETRY_MS 1000
+#define STREAM_BACKLOG 1
+
+typedef struct stream_rx_t {
+   struct list_head list;
+   size_t len;
+   char data[0];
+} stream_rx_t;
+
+
+static int
+stream_socket(stream_state_t *state, struct socket **sock)
+{
+   int err;
+
+   err = sock_create(state->family, SOCK_STREAM, state->protocol, sock);
+   if (err < 0) {
+      return err;
+   }
+   // Blocking calls give up regularly to check if thread must stop
+   (*sock)->sk->sk_rcvtimeo = msecs_to_jiffies(STREAM_RETRY_MS);
+   return 0;
+}
+
+/*
+  Wait for a peer, return the connected socket
+*/
+static int
+stream_establish(stream_state_t *state, struct socket **sock)
+{
+   int err;
+
+   if (!state->connect) {
+      err = kernel_accept(state->listen, sock, 0);
+      if (err < 0) {
+         return err;
+      }
+      (*sock)->sk->sk_rcvtimeo = msecs_to_jiffies(STREAM_RETRY_MS);
+      return 0;
+   }
+
+   err = stream_socket(state, sock);
+   if (err < 0) {
+      slog(state,ERR,"Unable to create socket [%d]",err);
+      return err;
+   }
+   (*sock)->sk->sk_sndtimeo = msecs_to_jiffies(STREAM_RETRY_MS);
+   err = kernel_connect(*sock, (struct sockaddr *)&state->addr, state->addrlen, 0);
+   if (err < 0) {
+      slog(state,DBG,"Unable to connect [%d]",err);
+      sock_release(*sock);
+      *sock = NULL;
+      return err;
+   }
+   (*sock)->sk->sk_sndtimeo = MAX_SCHEDULE_TIMEOUT;
+   return 0;
+}
+
+/*
+  Read exactly len bytes
+*/
+static int
+stream_read(stream_state_t *state, struct socket *sock, char *buf, size_t len)
+{
+   size_t done = 0;
+
+   while (done < len) {
+      struct msghdr msg = { .msg_flags = 0 };
+      struct kvec iov = { .iov_base = buf + done, .iov_len = len - done };
+      int r;
+
+      r = kernel_recvmsg(sock, &msg, &iov, 1, len - done, MSG_WAITALL);
+      if (r == -EAGAIN || r == -EINTR) {
+         if (kthread_should_stop()) {
+            return -EINTR;
+         }
+         continue;
+      } else if (r < 0) {
+         return r;
+      } else if (r == 0) {
+         return -ECONNRESET;
+      }
+      done += r;
+   }
+   return done;
+}
+
+static int
+stream_read_frame(stream_state_t *state, struct socket *sock)
+{
+   stream_rx_t *rx;
+   unsigned long flags;
+   char hdr[WIRE_MIN_HDR];
+   size_t size;
+   int err;
+
+   err = stream_read(state, sock, hdr, sizeof hdr);
+   if (err < 0) {
+      return err;
+   }
+
+   // Version in use is known once the header is there
+   size = com_frame_len(state->com, hdr);
+   if (size < sizeof hdr || size > MAX_SIZE_MSG + sizeof(msg_t)) {
+      slog(state,ERR,"Bad frame size %u, dropping peer",size);
+      return -EINVAL;
+   }
+
+   rx = kmalloc(sizeof *rx + size, GFP_KERNEL);
+   if (!rx) {
+      slog(state,ERR,"Unable to allocate memory");
+      return -ENOMEM;
+   }
+   rx->len = size;
+   memcpy(rx->data, hdr, sizeof hdr);
+
+   err = stream_read(state, sock, rx->data + sizeof hdr, size - sizeof hdr);
+   if (err < 0) {
+      kfree(rx);
+      return err;
+   }
+
+   spin_lock_irqsave(&state->rx_lock,flags);
+   list_add_tail(&rx->list,&state->rx);
+   spin_unlock_irqrestore(&state->rx_lock,flags);
+
+   state->cb(state->com, 0);
+   return 0;
+}
+
+static int
+stream_thread(void *data)
+{
+   stream_state_t *state = (stream_state_t *)data;
+
+   while (!kthread_should_stop()) {
+      struct socket *sock = NULL;
+      int err;
+
+      err = stream_establish(state, &sock);
+      if (err < 0) {
+         if (err != -EAGAIN && !kthread_should_stop()) {
+            msleep_interruptible(STREAM_RETRY_MS);
+         }
+         continue;
+      }
+
+      slog(state,INFO,"Peer connected");
+      if (state->ops && state->ops->setup) {
+         state->ops->setup(sock);
+      }
+      mutex_lock(&state->tx_lock);
+      state->sock = sock;
+      mutex_unlock(&state->tx_lock);
+
+      while (!kthread_should_stop()) {
+         err = stream_read_frame(state, sock);
+         if (err < 0) {
+            break;
+         }
+      }
+
+      slog(state,INFO,"Peer disconnected [%d]",err);
+      mutex_lock(&state->tx_lock);
+      state->sock = NULL;
+      mutex_unlock(&state->tx_lock);
+      sock_release(sock);
+   }
+
+   return 0;
+}
+
+static void
+stream_flush_work(struct work_struct *work)
+{
+   stream_state_t *state = container_of(work, stream_state_t, flush_work);
+
+   mutex_lock(&state->tx_lock);
+   if (state->sock) {
+      state->ops->flush(state->sock);
+   }
+   mutex_unlock(&state->tx_lock);
+}
+
+int
+stream_com_send(void *state, int flow, const char *buf, size_t len, int more)
+{
+   stream_state_t *s = (stream_state_t *)state;
+   size_t sz;
+   int flags = MSG_NOSIGNAL;
+   int err = 0;
+
+   if (more && s->ops && s->ops->flush) {
+      flags |= MSG_MORE;
+   }
+
+   mutex_lock(&s->tx_lock);
+   if (!s->sock) {
+      mutex_unlock(&s->tx_lock);
+      slog(s,DBG,"No peer connected, dropping msg");
+      return -ENOTCONN;
+   }
+
+   for (sz=0; sz!=len;) {
+      struct msghdr m = { .msg_flags = flags };
+      struct kvec iov = { .iov_base = (char *)buf + sz, .iov_len = len - sz };
+
+      err = kernel_sendmsg(s->sock, &m, &iov, 1, len - sz);
+      if (err < 0) {
+         slog(s,ERR,"Error during stream send : %d",err);
+         break;
+      }
+      sz += err;
+   }
+   mutex_unlock(&s->tx_lock);
+
+   // Frames held back are pushed once every pending sender is done
+   if (flags & MSG_MORE) {
+      queue_work(system_highpri_wq, &s->flush_work);
+   }
+
+   return err < 0 ? err : sz;
+}
+
+int
+stream_com_recv(void *state, int flow, char *buf, size_t maxlen)
+{
+   stream_state_t *s = (stream_state_t *)state;
+   stream_rx_t *rx;
+   unsigned long flags;
+   size_t len;
+
+   spin_lock_irqsave(&s->rx_lock,flags);
+   rx = list_first_entry_or_null(&s->rx, stream_rx_t, list);
+   if (rx) {
+      list_del(&rx->list);
+   }
+   spin_unlock_irqrestore(&s->rx_lock,flags);
+
+   if (!rx) {
+      return 0;
+   }
+
+   len = rx->len;
+   if (len > maxlen) {
+      slog(s,ERR,"Buffer too small in order to received data (sz_buffer:%u,total:%u)",maxlen,len);
+      kfree(rx);
+      return -EINVAL;
+   }
+   memcpy(buf, rx->data, len);
+   kfree(rx);
+
+   return len;
+}
+
+void*
+stream_com_init(com_t *com, int family, int protocol, struct sockaddr *addr, int addrlen, int connect, const stream_ops_t *ops, void (cb_recv)(com_t*, int))
+{
+   stream_state_t *state;
+   int err;
+
+   state = kzalloc(sizeof *state, GFP_KERNEL);
+   if (!state) {
+      com_log("STREAM",ERR,"Unable to allocate memory");
+      return ERR_PTR(-ENOMEM);
+   }
+
+   memcpy(&state->addr, addr, addrlen);
+   state->addrlen = addrlen;
+   state->family = family;
+   state->protocol = protocol;
+   state->connect = connect;
+   state->ops = ops;
+   INIT_WORK(&state->flush_work, stream_flush_work);
+   state->cb = cb_recv;
+   state->com = com;
+   mutex_init(&state->tx_lock);
+   spin_lock_init(&state->rx_lock);
+   INIT_LIST_HEAD(&state->rx);
+
+   if (!connect) {
+      err = stream_socket(state, &state->listen);
+      if (err < 0) {
+         slog(state,ERR,"Unable to create listening socket [%d]",err);
+         goto fail1;
+      }
+      state->listen->sk->sk_reuse = SK_CAN_REUSE;
+
+      err = kernel_bind(state->listen, (struct sockaddr *)&state->addr, addrlen);
+      if (err < 0) {
+         slog(state,ERR,"Unable to bind [%d]",err);
+         goto fail2;
+      }
+      err = kernel_listen(state->listen, STREAM_BACKLOG);
+      if (err < 0) {
+         slog(state,ERR,"Unable to listen [%d]",err);
+         goto fail2;
+      }
+   }
+
+   state->thread = kthread_run(stream_thread, state, "ubq_%s", com->id);
+   if (IS_ERR(state->thread)) {
+      slog(state,ERR,"Unable to start stream thread");
+      err = PTR_ERR(state->thread);
+      goto fail2;
+   }
+   com_rx_thread_setup(state->thread);
+
+   return (void *)state;
+
+ fail2:
+   if (state->listen) {
+      sock_release(state->listen);
+   }
+ fail1:
+   kfree(state);
+   return ERR_PTR(err);
+}
+
+void
+stream_com_close(void *state)
+{
+   stream_state_t *s = (stream_state_t *)state;
+   stream_rx_t *rx, *tmp;
+
+   kthread_stop(s->thread);
+   cancel_work_sync(&s->flush_work);
+   if (s->listen) {
+      sock_release(s->listen);
+   }
+
+   list_for_each_entry_safe(rx, tmp, &s->rx, list) {
+      list_del(&rx->list);
+      kfree(rx);
+   }
+   kfree(s);
+}
@@ -0,0 +1,50 @@
+#ifndef __COMM_STREAM_H
+#define __COMM_STREAM_H
+
+#include <linux/socket.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <net/sock.h>
+#include "com.h"
+
+struct stream_state_t;
+
+/*
+  Protocol specific hooks, all optional
+*/
+typedef struct stream_ops_t {
+   void (*setup)(struct socket *);  // Called on each connected socket
+   void (*flush)(struct socket *);  // Push data held back by MSG_MORE, batching is off without it
+} stream_ops_t;
+
+/*
+  Connected stream backend, shared by socket families
+  Frames are sent as is: the leading size field gives the frame length
+  A single peer is served at a time, others wait in the listen backlog
+*/
+typedef struct stream_state_t {
+   struct sockaddr_storage addr; // Listening address, or peer to connect to
+   int addrlen;
+   int family;
+   int protocol;
+   int connect;
+   struct socket *listen;
+   struct socket *sock;       // Connected peer, tx_lock held to change it
+   struct mutex tx_lock;
+   spinlock_t rx_lock;
+   struct list_head rx;       // Frames received, not yet read
+   struct task_struct *thread; // Accepts/connects and reads frames
+   const stream_ops_t *ops;
+   struct work_struct flush_work;
+   void (*cb)(com_t *, int); // Called when a new message is coming
+   com_t *com;
+} stream_state_t;
+
+
+/* API */
+void* stream_com_init(com_t *com, int family, int protocol, struct sockaddr *addr, int addrlen, int connect, const stream_ops_t *ops, void (cb_recv)(com_t*, int));
+void stream_com_close(void *state);
+int stream_com_send(void *state, int flow, const char *buf, size_t len, int more);
+int stream_com_recv(void *state, int flow, char *buf, size_t maxlen);
+
+#endif
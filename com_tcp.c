@@ -0,0 +1,53 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/in.h>
+#include <linux/tcp.h>
+#include <linux/version.h>
+#include <net/sock.h>
+#include <net/tcp.h>
+
+#include "msg.h"
+#include "com.h"
+#include "com_tcp.h"
+#include "debug.h"
+
+
+/*
+  Setting TCP_NODELAY also pushes what is pending
+*/
+static void
+tcp_set_nodelay(struct socket *sock)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,8,0)
+   int one = 1;
+   kernel_setsockopt(sock, SOL_TCP, TCP_NODELAY, (char *)&one, sizeof one);
+#else
+   tcp_sock_set_nodelay(sock->sk);
+#endif
+}
+
+/*
+  Control, interrupt and management traffic goes out at once
+  Bulk data is corked with MSG_MORE and pushed by the flush work
+*/
+static const stream_ops_t tcp_ops = {
+   .setup = tcp_set_nodelay,
+   .flush = tcp_set_nodelay,
+};
+
+/*
+  Same addressing as UDP: connect to addr:port, or listen on port
+*/
+void*
+tcp_com_init(com_t *com, void *opt, void (cb_recv)(com_t*, int))
+{
+   com_opt_t *o = (com_opt_t *)opt;
+   struct sockaddr_in addr;
+
+   memset(&addr, 0, sizeof addr);
+   addr.sin_family = AF_INET;
+   addr.sin_port = htons(o->port);
+   addr.sin_addr.s_addr = o->connect ? o->addr : INADDR_ANY;
+
+   return stream_com_init(com, AF_INET, IPPROTO_TCP, (struct sockaddr *)&addr, sizeof addr, o->connect, &tcp_ops, cb_recv);
+}
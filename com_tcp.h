@@ -0,0 +1,10 @@
+#ifndef __COMM_TCP_H
+#define __COMM_TCP_H
+
+#include "com.h"
+#include "com_stream.h"
+
+/* API, send/recv/close are the stream ones */
+void* tcp_com_init(com_t *com, void *opt, void (cb_recv)(com_t*, int));
+
+#endif
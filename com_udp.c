@@ -1,6 +1,7 @@
 #include <linux/module.h>
 #include <linux/init.h>
 #include <linux/in.h>
+#include <linux/udp.h>
 #include <net/sock.h>
 #include <linux/skbuff.h>
 #include <linux/delay.h>
@@ -13,7 +14,49 @@
 #include "com_udp.h"
 #include "debug.h"
 
+static int udp_batch = 0;
+module_param(udp_batch, int, 0444);
+MODULE_PARM_DESC(udp_batch, "Bytes of whole bulk frames corked in one datagram (0: one frame per datagram)");
 
+static bool udp_gro = false;
+module_param(udp_gro, bool, 0444);
+MODULE_PARM_DESC(udp_gro, "Let UDP GRO coalesce received datagrams");
+
+
+static int
+udp_set_opt(struct socket *sock, int opt, int val)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,9,0)
+   mm_segment_t oldfs;
+   int err;
+
+   oldfs = get_fs();
+   set_fs(KERNEL_DS);
+   err = sock->ops->setsockopt(sock, SOL_UDP, opt, (char __user *)&val, sizeof val);
+   set_fs(oldfs);
+   return err;
+#else
+   return sock->ops->setsockopt(sock, SOL_UDP, opt, KERNEL_SOCKPTR(&val), sizeof val);
+#endif
+}
+
+/*
+  Offloads are optional, failing to enable them is not fatal
+*/
+static void
+udp_offloads(udp_state_t *state)
+{
+   if (udp_gro) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,0,0)
+      int err = udp_set_opt(state->udpsocket, UDP_GRO, 1);
+      if (err < 0) {
+         slog(state,WRN,"Unable to enable UDP GRO [%d]",err);
+      }
+#else
+      slog(state,WRN,"UDP GRO needs a 5.0 kernel at least");
+#endif
+   }
+}
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,15,0)
 static void
@@ -23,41 +66,76 @@ static void
 udp_data_ready(struct sock *socket)
 #endif
 {
-   com_t *com = (com_t *)socket->sk_user_data;
-   udp_state_t *state = (udp_state_t *)com->state;
+   udp_state_t *state = (udp_state_t *)socket->sk_user_data;
    slog(state,INFO,"UDP MSG Ready %p %p",state,state->cb);
-   state->cb(socket->sk_user_data);
+   state->cb(state->com, state->idx);
 }
 
+static void udp_flush_work(struct work_struct *work);
+
 static int
-udp_init(udp_state_t *state, const udp_opt_t *opt)
+udp_init(udp_state_t *state, const com_opt_t *opt, unsigned short port)
 {
    int servererror;
    struct sockaddr_in *sockservaddr;
 
+   mutex_init(&state->tx_lock);
+   state->batch = clamp(udp_batch, 0, UDP_MAX_PAYLOAD);
+   state->corked = 0;
+   INIT_WORK(&state->flush_work, udp_flush_work);
+
+   state->rxbuf = kmalloc(UDP_MAX_DATAGRAM, GFP_KERNEL);
+   state->frame = kmalloc(UDP_MAX_FRAME, GFP_KERNEL);
+   if (!state->rxbuf || !state->frame) {
+      slog(state,ERR,"Unable to allocate memory");
+      kfree(state->rxbuf);
+      kfree(state->frame);
+      state->rxbuf = NULL;
+      state->frame = NULL;
+      return -ENOMEM;
+   }
+
    if(sock_create(PF_INET, SOCK_DGRAM, IPPROTO_UDP, &state->udpsocket) < 0) {
       slog(state,ERR,"Unable to create udpsocket");
+      kfree(state->rxbuf);
+      kfree(state->frame);
+      state->rxbuf = NULL;
+      state->frame = NULL;
       return -EIO;
    }
 
    state->udpsocket->sk->sk_data_ready = udp_data_ready;
-   state->udpsocket->sk->sk_user_data = state->com;
+   state->udpsocket->sk->sk_user_data = state;
+   udp_offloads(state);
 
    if(opt->connect == 0) {
       sockservaddr = &state->sockservaddr;
       sockservaddr->sin_family = AF_INET;
       sockservaddr->sin_addr.s_addr = INADDR_ANY;
-      sockservaddr->sin_port = htons(opt->port);
+      sockservaddr->sin_port = htons(port);
       servererror = state->udpsocket->ops->bind(state->udpsocket, (struct sockaddr *) sockservaddr, sizeof(*sockservaddr));
       if (servererror) {
          sock_release(state->udpsocket);
+         state->udpsocket = NULL;
+         kfree(state->rxbuf);
+         kfree(state->frame);
+         state->rxbuf = NULL;
+         state->frame = NULL;
          return -EIO;
       }
    } else {
       struct sockaddr_in *c = &state->clientaddr;
-      c->sin_port = htons(opt->port);
+      c->sin_port = htons(port);
       c->sin_addr.s_addr = opt->addr;
       c->sin_family = AF_INET;
+
+      // Route is looked up once, not on every send
+      servererror = kernel_connect(state->udpsocket, (struct sockaddr *)c, sizeof *c, 0);
+      if (servererror) {
+         slog(state,WRN,"Unable to connect UDP socket [%d], addressing each datagram",servererror);
+      } else {
+         state->connected = 1;
+      }
    }
 
    return 0;
@@ -66,48 +144,72 @@ udp_init(udp_state_t *state, const udp_opt_t *opt)
 static void
 udp_close(udp_state_t *state)
 {
+   cancel_work_sync(&state->flush_work);
    if(state->udpsocket != NULL) {
       sock_release(state->udpsocket);
       state->udpsocket = NULL;
    }
+   kfree(state->rxbuf);
+   state->rxbuf = NULL;
+   kfree(state->frame);
+   state->frame = NULL;
 }
 
 void*
-udp_com_init(com_t *com, void *opt, void (cb_recv)(com_t*))
+udp_com_init(com_t *com, void *opt, void (cb_recv)(com_t*, int))
 {
    int err;
-   udp_state_t *state;
+   int i;
+   udp_com_t *c;
+   com_opt_t *o = (com_opt_t*)opt;
 
-   state = kmalloc(sizeof *state, GFP_KERNEL);
-   if (!state) {
+   c = kzalloc(sizeof *c, GFP_KERNEL);
+   if (!c) {
       com_log("UDP",ERR,"Unable to allocate memory");
-      return NULL;
+      return ERR_PTR(-ENOMEM);
    }
 
-   state->cb = cb_recv;
-   state->com = com;
+   for (i=0; i<com->nb_flows; i++) {
+      udp_state_t *state = &c->flows[i];
 
-   err = udp_init(state,(udp_opt_t*)opt);
-   if (err < 0) {
-      kfree(state);
-      return NULL;
+      state->cb = cb_recv;
+      state->com = com;
+      state->idx = i;
+      state->fallback = &c->flows[0].clientaddr;
+
+      err = udp_init(state,o,o->port+i);
+      if (err < 0) {
+         goto fail;
+      }
+      c->nb_flows++;
    }
 
-   return (void *)state;
+   return (void *)c;
+
+ fail:
+   for (i=0; i<c->nb_flows; i++) {
+      udp_close(&c->flows[i]);
+   }
+   kfree(c);
+   return ERR_PTR(err);
 }
 
 
 void
 udp_com_close(void *state)
 {
-   udp_state_t *s = (udp_state_t *)state;
-   udp_close(s);
-   kfree(state);
+   udp_com_t *c = (udp_com_t *)state;
+   int i;
+
+   for (i=0; i<c->nb_flows; i++) {
+      udp_close(&c->flows[i]);
+   }
+   kfree(c);
 }
 
 
 static ssize_t
-raw_send(udp_state_t *state, unsigned char *buf, size_t len)
+raw_send(udp_state_t *state, unsigned char *buf, size_t len, int flags)
 {
    struct msghdr msg;
    struct iovec iov;
@@ -121,6 +223,10 @@ raw_send(udp_state_t *state, unsigned char *buf, size_t len)
       return 0;
    }
 
+   if (addr->sin_family == 0) {
+      addr = state->fallback;
+   }
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,19,0)
    iov.iov_base = buf;
    iov.iov_len = len;
@@ -132,9 +238,9 @@ raw_send(udp_state_t *state, unsigned char *buf, size_t len)
    iov_iter_init(&msg.msg_iter, WRITE, &iov, 1, len);
 #endif
 
-   msg.msg_flags = 0;
-   msg.msg_name = addr;
-   msg.msg_namelen  = sizeof(struct sockaddr_in);
+   msg.msg_flags = flags;
+   msg.msg_name = state->connected ? NULL : addr;
+   msg.msg_namelen  = state->connected ? 0 : sizeof(struct sockaddr_in);
    msg.msg_control = NULL;
    msg.msg_controllen = 0;
    msg.msg_control = NULL;
@@ -153,17 +259,16 @@ raw_send(udp_state_t *state, unsigned char *buf, size_t len)
 
 
 static int
-udp_send(udp_state_t *state, msg_t *msg)
+udp_send(udp_state_t *state, const char *buf, size_t len, int flags)
 {
    ssize_t sz;
-   size_t len = msg->size;
-   char *buf = (char *)&msg->size;
+   size_t total = len;
 
-   for(sz=0; sz!=msg->size;) {
+   for(sz=0; sz!=total;) {
       ssize_t s;
 
       slog(state,DBG,"UDP sending buf:%p sz_sent:%u still:%u",buf+sz,sz,len);
-      s = raw_send(state, buf+sz, len);
+      s = raw_send(state, (unsigned char *)buf+sz, len, flags);
       if (s < 0) {
          slog(state,ERR,"Error during UDP send : %d", s);
          return s;
@@ -179,11 +284,66 @@ udp_send(udp_state_t *state, msg_t *msg)
    return sz;
 }
 
+/*
+  Send the corked datagram, tx_lock held
+*/
+static void
+udp_push(udp_state_t *state)
+{
+   ssize_t err = raw_send(state, NULL, 0, 0);
+
+   if (err < 0) {
+      slog(state,WRN,"Unable to push UDP datagram [%d]",err);
+   }
+   state->corked = 0;
+}
+
+static void
+udp_flush_work(struct work_struct *work)
+{
+   udp_state_t *state = container_of(work, udp_state_t, flush_work);
+
+   mutex_lock(&state->tx_lock);
+   if (state->corked) {
+      udp_push(state);
+   }
+   mutex_unlock(&state->tx_lock);
+}
 
+/*
+  Bulk frames are corked with MSG_MORE so that several whole frames share one
+  datagram, the first frame sent without more closes it
+*/
 int
-udp_com_send(void *state, msg_t *msg)
+udp_com_send(void *state, int flow, const char *buf, size_t len, int more)
 {
-   return udp_send((udp_state_t*)state,msg);
+   udp_state_t *s = &((udp_com_t*)state)->flows[flow];
+   int flags = 0;
+   int err;
+
+   if (!s->batch) {
+      return udp_send(s,buf,len,0);
+   }
+
+   mutex_lock(&s->tx_lock);
+   // An oversized datagram is dropped by the stack, close the current one first
+   if (s->corked && s->corked + len > s->batch) {
+      udp_push(s);
+   }
+   if (more && len < s->batch) {
+      flags = MSG_MORE;
+   }
+   err = udp_send(s,buf,len,flags);
+   // A failed send drops the corked frames as well
+   s->corked = (flags && err > 0) ? s->corked + len : 0;
+   mutex_unlock(&s->tx_lock);
+
+   // Frames held back are pushed once every pending sender is done
+   if (flags) {
+      queue_work(system_highpri_wq, &s->flush_work);
+   }
+
+   return err;
 }
 
 
@@ -268,59 +428,93 @@ raw_recv(udp_state_t *state, unsigned char *addr, size_t len)
 }
 
 
+/*
+  Copy up to len bytes of received datagrams, reading a new one when needed
+*/
 static ssize_t
-udp_recv(udp_state_t *state, msg_t *msg)
+udp_pull(udp_state_t *state, char *buf, size_t len)
 {
-   ssize_t sz;
-   size_t len;
-   char *buf = (char *)&msg->size;
-
-   slog(state,DBG,"udp_recv");
+   size_t n;
 
-   sz = raw_recv(state, buf, msg->allocated_size);
-   if (sz < 0) {
-      slog(state,ERR,"Bad UDP recv %d",sz);
-      return -EINVAL;
-   } else if (sz < sizeof msg->size) {
-      slog(state,ERR,"Unable to read msg size [%u bytes read]",sz);
-      return -EINVAL;
-   } else if (msg->size < sz) {
-      slog(state,ERR,"Wrong size msg should be max %u but read %u bytes",msg->size,sz);
-      return -EINVAL;
-   } else if (sz == 0) {
-      return 0;
+   if (state->rx_off == state->rx_len) {
+      ssize_t sz = raw_recv(state, state->rxbuf, UDP_MAX_DATAGRAM);
+      if (sz <= 0) {
+         return sz;
+      }
+      state->rx_len = sz;
+      state->rx_off = 0;
    }
 
-   len = msg->size;
+   n = min(len, state->rx_len - state->rx_off);
+   memcpy(buf, state->rxbuf + state->rx_off, n);
+   state->rx_off += n;
+   return n;
+}
 
-   slog(state,DBG,"UDP Read size : %u total:%u buffer_sz:%u",sz,len,msg->allocated_size);
+/*
+  Drop the frame being assembled and what is left of the datagram
+*/
+static void
+udp_rx_reset(udp_state_t *state)
+{
+   state->rx_off = state->rx_len;
+   state->frame_len = 0;
+   state->frame_need = 0;
+}
 
-   if (len > msg->allocated_size) {
-      slog(state,ERR,"UDP Buffer too small in order to received data (sz_buffer:%u,total:%u)",msg->allocated_size,len);
-      return -EINVAL;
-   }
+/*
+  Frames are cut from the received byte stream: a datagram (or a GRO batch)
+  may carry several frames and a frame may span several datagrams. A frame
+  partly read when the socket runs dry is kept for the next call.
+*/
+static ssize_t
+udp_recv(udp_state_t *state, char *buf, size_t maxlen)
+{
+   ssize_t sz;
+
+   slog(state,DBG,"udp_recv");
 
-   for(; sz!=len;) {
+   for (;;) {
+      size_t need = state->frame_need ? state->frame_need : WIRE_MIN_HDR;
       ssize_t s;
 
-      slog(state,DBG,"UDP reading buf:%p sz_read:%u still:%u", buf+sz,sz,len-sz);
-      s = raw_recv(state, buf+sz, len-sz);
-      if (s < 0) {
+      if (state->frame_len == need) {
+         if (state->frame_need) {
+            break;
+         }
+         need = com_frame_len(state->com, state->frame);
+         if (need < WIRE_MIN_HDR || need > maxlen || need > UDP_MAX_FRAME) {
+            slog(state,ERR,"UDP Buffer too small in order to received data (sz_buffer:%u,total:%u)",maxlen,need);
+            udp_rx_reset(state);
+            return -EINVAL;
+         }
+         state->frame_need = need;
+         continue;
+      }
+
+      s = udp_pull(state, state->frame + state->frame_len, need - state->frame_len);
+      if (s == -EAGAIN || s == 0) {
+         slog(state,DBG,"No data, %u bytes of frame kept",state->frame_len);
+         return 0;
+      } else if (s < 0) {
          slog(state,ERR,"Error during UDP received : %d", s);
+         udp_rx_reset(state);
          return s;
-      } else if (s == 0) {
-         slog(state,DBG,"No data");
-      } else {
-         sz += s;
-         slog(state,DBG,"UDP read %u still:%u",s,len-sz);
       }
+      state->frame_len += s;
    }
 
+   sz = state->frame_need;
+   memcpy(buf, state->frame, sz);
+   state->frame_len = 0;
+   state->frame_need = 0;
+
+   slog(state,DBG,"UDP Read size : %u buffer_sz:%u",sz,maxlen);
    return sz;
 }
 
 int
-udp_com_recv(void *state, msg_t *msg)
+udp_com_recv(void *state, int flow, char *buf, size_t maxlen)
 {
-   return udp_recv((udp_state_t*)state,msg);
+   return udp_recv(&((udp_com_t*)state)->flows[flow],buf,maxlen);
 }
@@ -2,29 +2,51 @@
 #define __COMM_UDP_H
 
 #include <linux/in.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
 #include <net/sock.h>
 #include "com.h"
 
-typedef struct udp_opt_t {
-   unsigned short port;
-   __be32 addr;
-   int connect;
-} udp_opt_t;
-
-
+/*
+  One socket per flow, on consecutive ports
+*/
 typedef struct udp_state_t {
    struct sockaddr_in sockservaddr;
    struct sockaddr_in clientaddr;
+   struct sockaddr_in *fallback; // Peer of first flow, used until this one is known
    struct socket *udpsocket;
-   void (*cb)(com_t *); // Called when a new message is coming
+   int connected;
+   int idx;
+   void (*cb)(com_t *, int); // Called when a new message is coming
    com_t *com;
+   // Transmit, whole frames corked in one datagram up to batch bytes
+   struct mutex tx_lock;
+   size_t batch;
+   size_t corked;  // Bytes waiting in the corked datagram
+   struct work_struct flush_work;
+   // Receive, a datagram (or several with GRO) may carry several frames
+   char *rxbuf;
+   size_t rx_len;
+   size_t rx_off;
+   char *frame;      // Frame being assembled, kept when data runs out
+   size_t frame_len;
+   size_t frame_need; // Length of the frame once its header is read, 0 before
 } udp_state_t;
 
+typedef struct udp_com_t {
+   int nb_flows;
+   udp_state_t flows[COM_MAX_FLOWS];
+} udp_com_t;
+
+#define UDP_MAX_DATAGRAM 65535
+#define UDP_MAX_PAYLOAD 65507
+#define UDP_MAX_FRAME (MAX_SIZE_MSG + sizeof(msg_t) + sizeof(wire_hdr_t))
+
 
 /* API */
-void* udp_com_init(com_t *com, void *opt, void (cb_recv)(com_t*));
+void* udp_com_init(com_t *com, void *opt, void (cb_recv)(com_t*, int));
 void udp_com_close(void *state);
-int udp_com_send(void *state, msg_t *msg);
-int udp_com_recv(void *state, msg_t *msg);
+int udp_com_send(void *state, int flow, const char *buf, size_t len, int more);
+int udp_com_recv(void *state, int flow, char *buf, size_t maxlen);
 
 #endif
@@ -0,0 +1,29 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/vm_sockets.h>
+
+#include "msg.h"
+#include "com.h"
+#include "com_vsock.h"
+#include "debug.h"
+
+static unsigned int vsock_cid = VMADDR_CID_ANY;
+module_param(vsock_cid, uint, 0444);
+MODULE_PARM_DESC(vsock_cid, "vsock CID to connect to (default: listen on any CID)");
+
+/*
+  Channel port is used as vsock port
+*/
+void*
+vsock_com_init(com_t *com, void *opt, void (cb_recv)(com_t*, int))
+{
+   com_opt_t *o = (com_opt_t *)opt;
+   struct sockaddr_vm addr;
+
+   memset(&addr, 0, sizeof addr);
+   addr.svm_family = AF_VSOCK;
+   addr.svm_port = o->port;
+   addr.svm_cid = vsock_cid;
+
+   return stream_com_init(com, AF_VSOCK, 0, (struct sockaddr *)&addr, sizeof addr, vsock_cid != VMADDR_CID_ANY, NULL, cb_recv);
+}
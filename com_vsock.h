@@ -0,0 +1,10 @@
+#ifndef __COMM_VSOCK_H
+#define __COMM_VSOCK_H
+
+#include "com.h"
+#include "com_stream.h"
+
+/* API, send/recv/close are the stream ones */
+void* vsock_com_init(com_t *com, void *opt, void (cb_recv)(com_t*, int));
+
+#endif
@@ -1,7 +1,12 @@
+#include <linux/module.h>
+#include <linux/crc32.h>
+#include <linux/cpumask.h>
+#include <linux/version.h>
 #include "msg.h"
 #include "common.h"
 #include "types.h"
 #include "debug.h"
+#include "bench.h"
 
 #define CONFIG_COMMON_DEBUG
 
@@ -25,6 +30,46 @@
  *--------------------------------------------------------------------------------
  */
 
+static bool flow_control = false;
+module_param(flow_control, bool, 0444);
+MODULE_PARM_DESC(flow_control, "Gate OUT resubmits and IN refills on credits granted by the peer");
+
+static int initial_credits = 4;
+module_param(initial_credits, int, 0444);
+MODULE_PARM_DESC(initial_credits, "Credits of each endpoint when it is enabled");
+
+static int ack_window = 1;
+module_param(ack_window, int, 0444);
+MODULE_PARM_DESC(ack_window, "IN requests consumed by host before gadget sends an ACK, driver keeps as many URBs queued");
+
+static int ack_delay_usecs = 1000;
+module_param(ack_delay_usecs, int, 0444);
+MODULE_PARM_DESC(ack_delay_usecs, "Longest time a consumed IN request waits for its ACK");
+
+static bool int_delta = false;
+module_param(int_delta, bool, 0444);
+MODULE_PARM_DESC(int_delta, "Send interrupt IN payloads as DELTA of previous one when smaller (driver encodes, gadget decodes)");
+
+static bool int_latest = false;
+module_param(int_latest, bool, 0444);
+MODULE_PARM_DESC(int_latest, "Keep only the newest unsent interrupt IN report, drop superseded ones");
+
+static int ep_cpu[4] = { -1, -1, -1, -1 };
+module_param_array(ep_cpu, int, NULL, 0644);
+MODULE_PARM_DESC(ep_cpu, "CPU running the work of control, isoc, bulk and interrupt endpoints (-1: any)");
+
+static bool ep_highpri = false;
+module_param(ep_highpri, bool, 0444);
+MODULE_PARM_DESC(ep_highpri, "Run the work of isoc and interrupt endpoints on high priority workers");
+
+static bool usb_fast_path = false;
+module_param(usb_fast_path, bool, 0444);
+MODULE_PARM_DESC(usb_fast_path, "Forward successful bulk, interrupt and isoc transfers from USB completion, reusing the request (needs tx_sched)");
+
+static int deadline_usecs[4] = { 0, 0, 0, 0 };
+module_param_array(deadline_usecs, int, NULL, 0644);
+MODULE_PARM_DESC(deadline_usecs, "Time userland has to return a message of control (unused), isoc, bulk and interrupt endpoints before it is forwarded as is (0: no deadline)");
+
 #define SIZE_DEBUG_ENDPOINT 256
 static char debug_endpoint[SIZE_DEBUG_ENDPOINT];
 
@@ -34,6 +79,9 @@ char* dump_endpoint_id(const epid_t *ep)
    return debug_endpoint;
 }
 
+static void verdict_init(ep_t *ep);
+static void verdict_exit(ep_t *ep);
+
 int _create_endpoint(ep_t *ep, const epnum_t epnum, const eptype_t eptype, const epdir_t epdir,
                      const struct usb_endpoint_descriptor *desc, cb_conf_t *callbacks)
 {
@@ -58,8 +106,27 @@ int _create_endpoint(ep_t *ep, const epnum_t epnum, const eptype_t eptype, const
    snprintf(ep->name,128,"%s%d_%s",EP_TYPE_STR(ep->epid.type),ep->epid.num,EP_DIR_STR(ep->epid.dir));
 
    INIT_LIST_HEAD(&ep->reqlist);
+   spin_lock_init(&ep->reqlist_lock);
+   ep->ctx = NULL;
+   spin_lock_init(&ep->credit_lock);
+   ep_reset_credits(ep);
+   mutex_init(&ep->delta_lock);
+   ep->delta_last = NULL;
+   ep->delta_len = 0;
+   ep->delta_size = 0;
+   ep->delta_valid = 0;
+   atomic_set(&ep->latest_gen, 0);
+   atomic64_set(&ep->superseded, 0);
+   verdict_init(ep);
 
-   ep->wq = create_workqueue(ep->name);
+   if (IS_CTRL(ep)) {
+      // Setups and endpoint changes of the device are handled one at a time
+      ep->wq = alloc_ordered_workqueue("%s", WQ_MEM_RECLAIM, ep->name);
+   } else if (ep_highpri && (IS_ISOCHRONOUS(ep) || IS_INTERRUPT(ep))) {
+      ep->wq = alloc_workqueue("%s", WQ_MEM_RECLAIM | WQ_HIGHPRI, 1, ep->name);
+   } else {
+      ep->wq = create_workqueue(ep->name);
+   }
 
    ep->ops = &((*callbacks)[eptype]);
 
@@ -85,12 +152,44 @@ int create_endpoint(ep_t *ep, const struct usb_endpoint_descriptor *desc, cb_con
 
 void free_endpoint(ep_t *ep)
 {
+   if (atomic64_read(&ep->superseded)) {
+      log("COMMON",INFO,"%llu reports superseded on %s",(unsigned long long)atomic64_read(&ep->superseded),ep->name);
+   }
+   if (ep->expired) {
+      log("COMMON",INFO,"%llu messages forwarded past deadline on %s",ep->expired,ep->name);
+   }
    if (ep->desc) {
       kfree(ep->desc);
    }
+   verdict_exit(ep);
    flush_workqueue(ep->wq);
    destroy_workqueue(ep->wq);
    kfree(ep->name);
+   kfree(ep->delta_last);
+}
+
+/*
+  Endpoint lists are also walked by the other half (userland deadline),
+  so endpoints enter and leave them under ep_list_lock
+*/
+static DEFINE_SPINLOCK(ep_list_lock);
+
+void ep_list_add(ep_t *ep, struct list_head *list)
+{
+   unsigned long flags;
+
+   spin_lock_irqsave(&ep_list_lock,flags);
+   list_add(&ep->list,list);
+   spin_unlock_irqrestore(&ep_list_lock,flags);
+}
+
+void ep_list_del(ep_t *ep)
+{
+   unsigned long flags;
+
+   spin_lock_irqsave(&ep_list_lock,flags);
+   list_del_init(&ep->list);
+   spin_unlock_irqrestore(&ep_list_lock,flags);
 }
 
 ep_t* find_endpoint(const epid_t *id, struct list_head *list)
@@ -106,6 +205,23 @@ ep_t* find_endpoint(const epid_t *id, struct list_head *list)
 }
 
 
+/*
+  Queue work of an endpoint, on the CPU chosen for its type if any
+*/
+bool ep_queue_work(ep_t *ep, struct work_struct *work)
+{
+   int cpu = WORK_CPU_UNBOUND;
+
+   if (ep->epid.type < ARRAY_SIZE(ep_cpu)) {
+      int c = READ_ONCE(ep_cpu[ep->epid.type]);
+      if (c >= 0 && c < nr_cpu_ids && cpu_online(c)) {
+         cpu = c;
+      }
+   }
+   return queue_work_on(cpu, ep->wq, work);
+}
+
+
 /* Send messsage to userland */
 int send_userland(com_t *com, msg_t *msg)
 {
@@ -118,3 +234,569 @@ int send_userland(com_t *com, msg_t *msg)
 
    return sz;
 }
+
+
+/* -------------------------------------------------------------------------------
+ *
+ * Flow control
+ * A credit allows one more message to be sent to the peer on an endpoint
+ *
+ *--------------------------------------------------------------------------------
+ */
+
+int flow_control_enabled(void)
+{
+   return flow_control;
+}
+
+/*
+  One ACK may stand for several IN requests consumed by host
+*/
+int ack_window_size(void)
+{
+   return max(ack_window, 1);
+}
+
+unsigned long ack_delay(void)
+{
+   return usecs_to_jiffies(ack_delay_usecs);
+}
+
+/*
+  Number of IN requests an ACK stands for
+*/
+u32 ack_count(const msg_t *msg)
+{
+   const ack_window_t *a = (const ack_window_t *)msg->ack_data;
+
+   if (msg_get_data_size(msg) < sizeof *a) {
+      return 1;
+   }
+   return le32_to_cpu(a->count);
+}
+
+void ep_reset_credits(ep_t *ep)
+{
+   unsigned long flags;
+
+   spin_lock_irqsave(&ep->credit_lock,flags);
+   ep->credits = initial_credits;
+   ep->starved = 0;
+   spin_unlock_irqrestore(&ep->credit_lock,flags);
+}
+
+/*
+  Return 1 if endpoint may resubmit now
+  Otherwise endpoint is starved until ep_grant_credits
+*/
+int ep_take_credit(ep_t *ep)
+{
+   unsigned long flags;
+   int ret = 1;
+
+   if (!flow_control) {
+      return 1;
+   }
+
+   spin_lock_irqsave(&ep->credit_lock,flags);
+   if (ep->credits > 0) {
+      ep->credits--;
+   } else {
+      ep->starved = 1;
+      ret = 0;
+   }
+   spin_unlock_irqrestore(&ep->credit_lock,flags);
+
+   return ret;
+}
+
+/*
+  Return 1 if a starved endpoint must resubmit now, credit is taken for it
+*/
+int ep_grant_credits(ep_t *ep, u32 credits)
+{
+   unsigned long flags;
+   int ret = 0;
+
+   spin_lock_irqsave(&ep->credit_lock,flags);
+   ep->credits += credits;
+   if (ep->starved && ep->credits > 0) {
+      ep->starved = 0;
+      ep->credits--;
+      ret = 1;
+   }
+   spin_unlock_irqrestore(&ep->credit_lock,flags);
+
+   return ret;
+}
+
+
+/* -------------------------------------------------------------------------------
+ *
+ * Interrupt IN delta encoding
+ * Payloads are given against the last one of the endpoint, both sides keep it
+ *
+ *--------------------------------------------------------------------------------
+ */
+
+static int
+delta_enabled(const ep_t *ep)
+{
+   return int_delta && IS_IN(ep) && IS_INTERRUPT(ep);
+}
+
+// delta_lock held
+static void
+delta_store(ep_t *ep, const char *data, size_t len)
+{
+   if (len > ep->delta_size) {
+      kfree(ep->delta_last);
+      ep->delta_last = kmalloc(len, GFP_KERNEL);
+      if (!ep->delta_last) {
+         ep->delta_size = 0;
+         ep->delta_valid = 0;
+         return;
+      }
+      ep->delta_size = len;
+   }
+   memcpy(ep->delta_last, data, len);
+   ep->delta_len = len;
+   ep->delta_valid = 1;
+}
+
+void ep_delta_reset(ep_t *ep)
+{
+   mutex_lock(&ep->delta_lock);
+   ep->delta_valid = 0;
+   mutex_unlock(&ep->delta_lock);
+}
+
+/*
+  Return a DELTA message to send instead of msg, NULL to send msg as is
+  Base is left untouched, see ep_delta_commit
+*/
+msg_t* ep_delta_encode(ep_t *ep, const msg_t *msg)
+{
+   const char *data = msg_get_data(msg);
+   size_t len = msg_get_data_size(msg);
+   msg_t *m = NULL;
+   size_t nb = 0;
+   size_t i;
+
+   if (!delta_enabled(ep)) {
+      return NULL;
+   }
+
+   mutex_lock(&ep->delta_lock);
+   if (ep->delta_valid && ep->delta_len == len) {
+      for (i=0; i<len; i++) {
+         nb += data[i] != ep->delta_last[i];
+      }
+
+      // Same payload only costs its header, the CRC checks the peer base
+      if (nb == 0 ? sizeof(delta_hdr_t) < len : sizeof(delta_hdr_t) + nb * sizeof(delta_t) < len / 2) {
+         m = alloc_msg(sizeof(delta_hdr_t) + nb * sizeof(delta_t), DELTA);
+         if (m) {
+            delta_hdr_t h;
+
+            h.len = cpu_to_le16(len);
+            h.crc = cpu_to_le32(crc32_le(0, data, len));
+            msgcpy(m, &h, sizeof h);
+            for (i=0; i<len; i++) {
+               if (data[i] != ep->delta_last[i]) {
+                  delta_t d;
+                  d.offset = cpu_to_le16(i);
+                  d.xor = data[i] ^ ep->delta_last[i];
+                  msgcpy(m, &d, sizeof d);
+               }
+            }
+         }
+      }
+      if (m) {
+         msg_set_epid(m, &ep->epid);
+      }
+   }
+   mutex_unlock(&ep->delta_lock);
+
+   return m;
+}
+
+/*
+  Payload of msg reached the peer, next DELTA messages are given against it
+*/
+void ep_delta_commit(ep_t *ep, const msg_t *msg)
+{
+   if (!delta_enabled(ep)) {
+      return;
+   }
+
+   mutex_lock(&ep->delta_lock);
+   delta_store(ep, msg_get_data(msg), msg_get_data_size(msg));
+   mutex_unlock(&ep->delta_lock);
+}
+
+/*
+  DATA payload becomes the base of next DELTA messages
+  DELTA is rebuilt into *full, a new DATA message
+  Return -EPROTO if payload cannot be rebuilt, sender must then start over
+*/
+int ep_delta_decode(ep_t *ep, const msg_t *msg, msg_t **full)
+{
+   const char *data = msg_get_data(msg);
+   size_t len = msg_get_data_size(msg);
+   msg_t *m = NULL;
+   delta_hdr_t h;
+   size_t i;
+
+   *full = NULL;
+
+   if (IS_USB_DATA(msg)) {
+      ep_delta_commit(ep, msg);
+      return 0;
+   } else if (!IS_USB_DELTA(msg)) {
+      return 0;
+   }
+
+   mutex_lock(&ep->delta_lock);
+   if (!ep->delta_valid) {
+      goto fail;
+   }
+
+   m = alloc_msg(ep->delta_len, DATA);
+   if (!m) {
+      goto fail;
+   }
+   msg_set_epid(m, &ep->epid);
+   msgcpy(m, ep->delta_last, ep->delta_len);
+
+   if (len < sizeof h) {
+      goto fail;
+   }
+   memcpy(&h, data, sizeof h);
+   if (le16_to_cpu(h.len) != ep->delta_len) {
+      goto fail;
+   }
+   for (i=sizeof h; i + sizeof(delta_t) <= len; i+=sizeof(delta_t)) {
+      delta_t d;
+      memcpy(&d, data + i, sizeof d);
+      if (le16_to_cpu(d.offset) >= ep->delta_len) {
+         goto fail;
+      }
+      m->data[le16_to_cpu(d.offset)] ^= d.xor;
+   }
+   // Diverged base shows here, even with no byte changed
+   if (crc32_le(0, m->data, ep->delta_len) != le32_to_cpu(h.crc)) {
+      goto fail;
+   }
+   delta_store(ep, m->data, ep->delta_len);
+   mutex_unlock(&ep->delta_lock);
+
+   *full = m;
+   return 0;
+
+ fail:
+   ep->delta_valid = 0;
+   mutex_unlock(&ep->delta_lock);
+   if (m) {
+      free_msg(m);
+   }
+   return -EPROTO;
+}
+
+
+/* -------------------------------------------------------------------------------
+ *
+ * Latest value policy of interrupt IN
+ * A report nobody sent yet is dropped as soon as a newer one is there
+ *
+ *--------------------------------------------------------------------------------
+ */
+
+int ep_latest_enabled(const ep_t *ep)
+{
+   return int_latest && IS_IN(ep) && IS_INTERRUPT(ep);
+}
+
+/*
+  Called when a report is completed, return its generation
+*/
+u32 ep_latest_stamp(ep_t *ep)
+{
+   return atomic_inc_return(&ep->latest_gen);
+}
+
+/*
+  Return 1 if a report completed after the one of generation gen
+*/
+int ep_latest_superseded(ep_t *ep, u32 gen)
+{
+   if (gen == (u32)atomic_read(&ep->latest_gen)) {
+      return 0;
+   }
+   atomic64_inc(&ep->superseded);
+   return 1;
+}
+
+
+/* -------------------------------------------------------------------------------
+ *
+ * Completion fast path
+ * Common transfers are forwarded without going through the endpoint workqueue
+ *
+ *--------------------------------------------------------------------------------
+ */
+
+/*
+  Return 1 if a completed transfer of ep may be forwarded from completion context
+  Sending must not sleep: frame is only copied for the transmit thread
+*/
+int ep_fast_path(const ep_t *ep, const com_t *com, const msg_t *msg)
+{
+   return usb_fast_path && !IS_CTRL(ep) && !delta_enabled(ep) && com_send_atomic(com, msg);
+}
+
+
+/* -------------------------------------------------------------------------------
+ *
+ * Userland deadline
+ * A message sent to userland is also kept by the endpoint of the other half
+ * expecting it. Unless userland returns a message (modified or not) in time,
+ * the copy is forwarded as is. The message carries a tag, the verdict settles
+ * the copy of the same tag; a verdict whose copy was already forwarded is
+ * dropped, untagged DATA from userland settles nothing
+ *
+ *--------------------------------------------------------------------------------
+ */
+
+typedef struct verdict_t {
+   struct list_head list;
+   ktime_t deadline;
+   u32 tag;
+   msg_t *msg;
+} verdict_t;
+
+static atomic_t verdict_tags = ATOMIC_INIT(0);
+
+static int
+deadline_of(const epid_t *id)
+{
+   if (id->type == CTRL || id->type >= ARRAY_SIZE(deadline_usecs)) {
+      return 0;
+   }
+   return max(READ_ONCE(deadline_usecs[id->type]), 0);
+}
+
+/*
+  Run by the endpoint workqueue once the oldest message is due
+*/
+static void
+verdict_expire(struct work_struct *work)
+{
+   ep_t *ep = container_of(work, ep_t, verdict_work);
+   verdict_t *v, *tmp;
+   unsigned long flags;
+   ktime_t now = ktime_get();
+   LIST_HEAD(expired);
+   int err;
+
+   mutex_lock(&ep->verdict_lock);
+
+   spin_lock_irqsave(&ep->verdict_list_lock,flags);
+   list_for_each_entry_safe(v, tmp, &ep->verdicts, list) {
+      if (ktime_after(v->deadline, now)) {
+         if (!ep->verdict_dying) {
+            hrtimer_start(&ep->verdict_timer, v->deadline, HRTIMER_MODE_ABS);
+         }
+         break;
+      }
+      list_move_tail(&v->list, &expired);
+   }
+   spin_unlock_irqrestore(&ep->verdict_list_lock,flags);
+
+   list_for_each_entry_safe(v, tmp, &expired, list) {
+      log("COMMON",DBG,"Deadline missed on %s, forwarding as is",ep->name);
+      err = ep->ops->recv_userland(ep, v->msg);
+      if (err<0) {
+         log("COMMON",ERR,"Unable to forward message [%d] on %s",err,ep->name);
+      }
+      ep->expired++;
+      bench_count(IS_IN(ep) ? BENCH_IN_DEADLINE_MISSED : BENCH_OUT_DEADLINE_MISSED);
+      list_del(&v->list);
+      kfree(v->msg);
+      kfree(v);
+   }
+
+   mutex_unlock(&ep->verdict_lock);
+}
+
+static enum hrtimer_restart
+verdict_timer(struct hrtimer *timer)
+{
+   ep_t *ep = container_of(timer, ep_t, verdict_timer);
+
+   ep_queue_work(ep, &ep->verdict_work);
+   return HRTIMER_NORESTART;
+}
+
+static void
+verdict_init(ep_t *ep)
+{
+   mutex_init(&ep->verdict_lock);
+   spin_lock_init(&ep->verdict_list_lock);
+   INIT_LIST_HEAD(&ep->verdicts);
+   ep->verdict_dying = 0;
+   ep->expired = 0;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,13,0)
+   hrtimer_init(&ep->verdict_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+   ep->verdict_timer.function = verdict_timer;
+#else
+   hrtimer_setup(&ep->verdict_timer, verdict_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+#endif
+   INIT_WORK(&ep->verdict_work, verdict_expire);
+}
+
+/*
+  Endpoint workqueue is flushed afterwards
+  Once dying, ep_verdict_expect neither keeps a message nor arms the timer
+*/
+static void
+verdict_exit(ep_t *ep)
+{
+   verdict_t *v, *tmp;
+   unsigned long flags;
+   LIST_HEAD(pending);
+
+   spin_lock_irqsave(&ep->verdict_list_lock,flags);
+   ep->verdict_dying = 1;
+   list_splice_init(&ep->verdicts, &pending);
+   spin_unlock_irqrestore(&ep->verdict_list_lock,flags);
+
+   hrtimer_cancel(&ep->verdict_timer);
+   cancel_work_sync(&ep->verdict_work);
+
+   list_for_each_entry_safe(v, tmp, &pending, list) {
+      list_del(&v->list);
+      kfree(v->msg);
+      kfree(v);
+   }
+}
+
+/*
+  Return 1 if msg sent to userland by ep must be kept by the other half
+  Verdicts are told apart by their tag, which v1 frames cannot carry
+*/
+int ep_deadline_enabled(const ep_t *ep, const com_t *com, const msg_t *msg)
+{
+   return IS_USB_DATA(msg) && deadline_of(&ep->epid) > 0 && com_tagged(com);
+}
+
+/*
+  msg goes to userland, endpoint of peers it is for forwards a copy of it
+  unless a verdict comes in time
+  msg gets the tag userland must echo, 0 if nothing was kept
+  May be called from completion context
+*/
+void ep_verdict_expect(struct list_head *peers, msg_t *msg)
+{
+   verdict_t *v;
+   ep_t *peer;
+   unsigned long flags;
+   int usecs;
+   int kept = 0;
+
+   msg->tag = 0;
+   if (!peers || (usecs = deadline_of(&msg->epid)) == 0) {
+      return;
+   }
+
+   v = kmalloc(sizeof *v, GFP_ATOMIC);
+   if (!v) {
+      return;
+   }
+   v->msg = kmalloc(msg->size + MSG_HEAD_SIZE, GFP_ATOMIC);
+   if (!v->msg) {
+      kfree(v);
+      return;
+   }
+   memcpy(v->msg, msg, msg->size + MSG_HEAD_SIZE);
+   v->msg->allocated_size = msg_get_data_size(msg);
+   v->msg->tag = 0;
+   v->deadline = ktime_add_us(ktime_get(), usecs);
+   do {
+      v->tag = atomic_inc_return(&verdict_tags);
+   } while (v->tag == 0);
+
+   // Peer cannot be freed meanwhile, it leaves its list first
+   spin_lock_irqsave(&ep_list_lock,flags);
+   peer = find_endpoint(&msg->epid, peers);
+   if (peer) {
+      spin_lock(&peer->verdict_list_lock);
+      if (!peer->verdict_dying) {
+         if (list_empty(&peer->verdicts)) {
+            hrtimer_start(&peer->verdict_timer, v->deadline, HRTIMER_MODE_ABS);
+         }
+         list_add_tail(&v->list, &peer->verdicts);
+         kept = 1;
+      }
+      spin_unlock(&peer->verdict_list_lock);
+   }
+   spin_unlock_irqrestore(&ep_list_lock,flags);
+
+   if (!kept) {
+      kfree(v->msg);
+      kfree(v);
+      return;
+   }
+   msg->tag = v->tag;
+}
+
+/*
+  Return 0 if the verdict is late, its message was already forwarded
+  Otherwise message of the same tag is settled
+*/
+static int
+verdict_settle(ep_t *ep, u32 tag)
+{
+   verdict_t *v, *found = NULL;
+   unsigned long flags;
+
+   spin_lock_irqsave(&ep->verdict_list_lock,flags);
+   list_for_each_entry(v, &ep->verdicts, list) {
+      if (v->tag == tag) {
+         list_del(&v->list);
+         found = v;
+         break;
+      }
+   }
+   spin_unlock_irqrestore(&ep->verdict_list_lock,flags);
+
+   if (!found) {
+      return 0;
+   }
+   kfree(found->msg);
+   kfree(found);
+   return 1;
+}
+
+/*
+  Message received from userland for ep
+*/
+int ep_recv_userland(ep_t *ep, msg_t *msg)
+{
+   int err = 0;
+
+   // Untagged DATA is userland own, not a verdict
+   if (IS_CTRL(ep) || !IS_USB_DATA(msg) || !msg->tag) {
+      return ep->ops->recv_userland(ep, msg);
+   }
+
+   mutex_lock(&ep->verdict_lock);
+   if (verdict_settle(ep, msg->tag)) {
+      err = ep->ops->recv_userland(ep, msg);
+   } else {
+      log("COMMON",DBG,"Late verdict dropped on %s",ep->name);
+   }
+   mutex_unlock(&ep->verdict_lock);
+
+   return err;
+}
@@ -42,9 +42,46 @@ int create_ep0_endpoint(ep_t *ep, const epdir_t epdir, cb_conf_t *callbacks);
 int create_endpoint(ep_t *ep, const struct usb_endpoint_descriptor *desc, cb_conf_t *callbacks);
 void free_endpoint(ep_t *ep);
 ep_t* find_endpoint(const epid_t *id, struct list_head *list);
+void ep_list_add(ep_t *ep, struct list_head *list);
+void ep_list_del(ep_t *ep);
+bool ep_queue_work(ep_t *ep, struct work_struct *work);
 char* dump_endpoint_id(const epid_t *ep);
 
 // Userland communication
 int send_userland(com_t *com, msg_t *msg);
 
+// Flow control
+int flow_control_enabled(void);
+void ep_reset_credits(ep_t *ep);
+int ep_take_credit(ep_t *ep);
+int ep_grant_credits(ep_t *ep, u32 credits);
+
+// Windowed ACK
+int ack_window_size(void);
+unsigned long ack_delay(void);
+u32 ack_count(const msg_t *msg);
+
+// Interrupt IN delta encoding
+void ep_delta_reset(ep_t *ep);
+msg_t* ep_delta_encode(ep_t *ep, const msg_t *msg);
+void ep_delta_commit(ep_t *ep, const msg_t *msg);
+int ep_delta_decode(ep_t *ep, const msg_t *msg, msg_t **full);
+
+// Latest value policy of interrupt IN
+int ep_latest_enabled(const ep_t *ep);
+u32 ep_latest_stamp(ep_t *ep);
+int ep_latest_superseded(ep_t *ep, u32 gen);
+
+// Completion fast path
+int ep_fast_path(const ep_t *ep, const com_t *com, const msg_t *msg);
+
+// Userland deadline
+int ep_deadline_enabled(const ep_t *ep, const com_t *com, const msg_t *msg);
+void ep_verdict_expect(struct list_head *peers, msg_t *msg);
+int ep_recv_userland(ep_t *ep, msg_t *msg);
+
+// Endpoint list of instance idx on the other half, NULL if not active
+struct list_head* gadget_peer_endpoints(int idx);
+struct list_head* driver_peer_endpoints(int idx);
+
 #endif
@@ -3,6 +3,8 @@
 #include <linux/device.h>
 #include <linux/module.h>
 
+#include "bench.h"
+
 int ubq_gadget_init(void);
 void ubq_gadget_exit(void);
 
@@ -12,11 +14,17 @@ void ubq_driver_exit(void);
 static int __init ubq_core_init(void)
 {
    int retval;
-   retval = ubq_gadget_init();
+   retval = bench_init();
    if(retval < 0) return retval;
+   retval = ubq_gadget_init();
+   if(retval < 0) {
+      bench_exit();
+      return retval;
+   }
    retval = ubq_driver_init();
    if(retval < 0) {
       ubq_gadget_exit();
+      bench_exit();
       return retval;
    }
    return retval;
@@ -26,6 +34,7 @@ static void __exit ubq_core_exit(void)
 {
    ubq_gadget_exit();
    ubq_driver_exit();
+   bench_exit();
 }
 
 module_init(ubq_core_init);
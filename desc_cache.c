@@ -0,0 +1,376 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+
+#include "desc_cache.h"
+#include "common.h"
+#include "debug.h"
+
+#ifndef CONFIG_DESC_CACHE_DEBUG_LEVEL
+#define CONFIG_DESC_CACHE_DEBUG_LEVEL INFO
+#endif
+
+#define log(lvl,fmt, ...) _log("CACHE",CONFIG_DESC_CACHE_DEBUG_LEVEL,lvl,fmt, ##__VA_ARGS__)
+
+#define MAX_SIZE_SERIAL 128
+
+static int desc_cache_size = 8;
+module_param(desc_cache_size, int, 0444);
+MODULE_PARM_DESC(desc_cache_size, "Number of devices kept in descriptor cache (0 disables it)");
+
+typedef struct desc_response_t {
+   struct list_head list;
+   u16 wValue;
+   u16 wIndex;
+   u16 wLength;  // Length requested when response was recorded
+   int volatile_; // Response changed between two enumerations, never serve it
+   size_t len;
+   char data[0];
+} desc_response_t;
+
+struct desc_cache_entry_t {
+   struct list_head list;
+   identity_t identity;
+   char serial[MAX_SIZE_SERIAL];
+   size_t serial_len;
+   int users;
+   struct list_head responses;
+};
+
+static struct desc_cache_state_t {
+   struct mutex lock;
+   struct list_head entries; // Most recently used first
+   int nb_entries;
+} desc_cache_state;
+
+
+int
+desc_cache_enabled(void)
+{
+   return desc_cache_size > 0;
+}
+
+static int
+same_device(const struct usb_device_descriptor *a, const struct usb_device_descriptor *b)
+{
+   return a->idVendor == b->idVendor && a->idProduct == b->idProduct && a->bcdDevice == b->bcdDevice;
+}
+
+/*
+  Compare descriptors only, active/target are scratch and slots past
+  nb_int or bNumEndpoints are not filled in
+*/
+static int
+same_identity(const identity_t *a, const identity_t *b)
+{
+   uint i;
+
+   if (a->speed != b->speed || a->nb_int != b->nb_int
+       || memcmp(&a->device, &b->device, sizeof a->device)
+       || memcmp(&a->conf, &b->conf, sizeof a->conf)) {
+      return 0;
+   }
+
+   for (i=0; i<min_t(uint, a->nb_int, MAX_INTERFACE_CONFIGURATION); i++) {
+      const interface_desc_t *ia = &a->interfaces[i];
+      const interface_desc_t *ib = &b->interfaces[i];
+      size_t nb_ep = min_t(size_t, ia->desc.bNumEndpoints, MAX_ENDPOINT_INTERFACE);
+
+      if (memcmp(&ia->desc, &ib->desc, sizeof ia->desc)
+          || memcmp(ia->endpoints, ib->endpoints, nb_ep * sizeof ia->endpoints[0])) {
+         return 0;
+      }
+   }
+   return 1;
+}
+
+static void
+flush_responses(desc_cache_entry_t *entry)
+{
+   desc_response_t *resp, *tmp;
+
+   list_for_each_entry_safe(resp, tmp, &entry->responses, list) {
+      list_del(&resp->list);
+      kfree(resp);
+   }
+}
+
+static desc_response_t*
+find_response(desc_cache_entry_t *entry, const struct usb_ctrlrequest *ctrl)
+{
+   desc_response_t *resp;
+
+   list_for_each_entry(resp, &entry->responses, list) {
+      if (resp->wValue == le16_to_cpu(ctrl->wValue) && resp->wIndex == le16_to_cpu(ctrl->wIndex)) {
+         return resp;
+      }
+   }
+   return NULL;
+}
+
+/*
+  Drop least recently used entry not currently in use
+  Return 0 if every entry is in use
+*/
+static int
+evict_entry(void)
+{
+   desc_cache_entry_t *entry;
+
+   list_for_each_entry_reverse(entry, &desc_cache_state.entries, list) {
+      if (!entry->users) {
+         log(DBG,"Evict %04x:%04x",le16_to_cpu(entry->identity.device.idVendor),le16_to_cpu(entry->identity.device.idProduct));
+         list_del(&entry->list);
+         flush_responses(entry);
+         kfree(entry);
+         desc_cache_state.nb_entries--;
+         return 1;
+      }
+   }
+   return 0;
+}
+
+static desc_cache_entry_t*
+alloc_entry(const identity_t *identity)
+{
+   desc_cache_entry_t *entry;
+
+   // Cache never grows past its bound, device then runs uncached
+   if (desc_cache_state.nb_entries >= desc_cache_size && !evict_entry()) {
+      log(INFO,"Every cache entry in use, %04x:%04x not cached",le16_to_cpu(identity->device.idVendor),le16_to_cpu(identity->device.idProduct));
+      return NULL;
+   }
+
+   entry = kzalloc(sizeof *entry, GFP_KERNEL);
+   if (!entry) {
+      log(ERR,"Unable to allocate memory");
+      return NULL;
+   }
+   memcpy(&entry->identity, identity, sizeof *identity);
+   INIT_LIST_HEAD(&entry->responses);
+   list_add(&entry->list, &desc_cache_state.entries);
+   desc_cache_state.nb_entries++;
+
+   return entry;
+}
+
+/*
+  Find most recent entry for this device, or create it
+  Cached responses are dropped if the identity changed
+*/
+desc_cache_entry_t*
+desc_cache_get(const identity_t *identity)
+{
+   desc_cache_entry_t *entry;
+
+   if (!desc_cache_enabled()) {
+      return NULL;
+   }
+
+   mutex_lock(&desc_cache_state.lock);
+   list_for_each_entry(entry, &desc_cache_state.entries, list) {
+      if (same_device(&entry->identity.device, &identity->device)) {
+         list_move(&entry->list, &desc_cache_state.entries);
+         if (!same_identity(&entry->identity, identity)) {
+            log(INFO,"Identity changed, flush cached descriptors");
+            flush_responses(entry);
+            memcpy(&entry->identity, identity, sizeof *identity);
+         }
+         goto found;
+      }
+   }
+
+   entry = alloc_entry(identity);
+   if (!entry) {
+      mutex_unlock(&desc_cache_state.lock);
+      return NULL;
+   }
+
+ found:
+   entry->users++;
+   mutex_unlock(&desc_cache_state.lock);
+   return entry;
+}
+
+void
+desc_cache_put(desc_cache_entry_t *entry)
+{
+   if (!entry) {
+      return;
+   }
+   mutex_lock(&desc_cache_state.lock);
+   entry->users--;
+   mutex_unlock(&desc_cache_state.lock);
+}
+
+/*
+  Copy cached response into buf (at most wLength bytes)
+  Return 1 if the request can be answered from cache
+*/
+int
+desc_cache_lookup(desc_cache_entry_t *entry, const struct usb_ctrlrequest *ctrl, char *buf, size_t *len)
+{
+   desc_response_t *resp;
+   u16 wLength = le16_to_cpu(ctrl->wLength);
+   int ret = 0;
+
+   if (!entry) {
+      return 0;
+   }
+
+   mutex_lock(&desc_cache_state.lock);
+   resp = find_response(entry, ctrl);
+   // Response is complete when shorter than what was requested
+   if (resp && !resp->volatile_ && (resp->len < resp->wLength || wLength <= resp->wLength)) {
+      *len = min_t(size_t, resp->len, wLength);
+      memcpy(buf, resp->data, *len);
+      ret = 1;
+   }
+   mutex_unlock(&desc_cache_state.lock);
+
+   return ret;
+}
+
+/*
+  Record a live response
+  Return 1 if it differs from what was cached
+*/
+int
+desc_cache_store(desc_cache_entry_t *entry, const struct usb_ctrlrequest *ctrl, const char *buf, size_t len)
+{
+   desc_response_t *resp, *old;
+   u16 wLength = le16_to_cpu(ctrl->wLength);
+   int changed = 0;
+
+   if (!entry) {
+      return 0;
+   }
+
+   mutex_lock(&desc_cache_state.lock);
+   old = find_response(entry, ctrl);
+   if (old) {
+      size_t common = min(old->len, len);
+      if (memcmp(old->data, buf, common) ||
+          (old->len != len && (old->len < old->wLength || len < wLength))) {
+         changed = 1;
+      } else if (wLength <= old->wLength) {
+         // Nothing new
+         goto end;
+      }
+   }
+
+   resp = kmalloc(sizeof *resp + len, GFP_KERNEL);
+   if (!resp) {
+      log(ERR,"Unable to allocate memory");
+      goto end;
+   }
+   resp->wValue = le16_to_cpu(ctrl->wValue);
+   resp->wIndex = le16_to_cpu(ctrl->wIndex);
+   resp->wLength = wLength;
+   resp->volatile_ = changed || (old && old->volatile_);
+   resp->len = len;
+   memcpy(resp->data, buf, len);
+
+   if (old) {
+      list_replace(&old->list, &resp->list);
+      kfree(old);
+   } else {
+      list_add_tail(&resp->list, &entry->responses);
+   }
+
+ end:
+   mutex_unlock(&desc_cache_state.lock);
+   return changed;
+}
+
+void
+desc_cache_forget(desc_cache_entry_t *entry, const struct usb_ctrlrequest *ctrl)
+{
+   desc_response_t *resp;
+
+   if (!entry) {
+      return;
+   }
+   mutex_lock(&desc_cache_state.lock);
+   resp = find_response(entry, ctrl);
+   if (resp) {
+      resp->volatile_ = 1;
+   }
+   mutex_unlock(&desc_cache_state.lock);
+}
+
+/*
+  Serial is known once the live serial string descriptor is received
+  Return the entry matching the complete key, which may be a new one
+*/
+desc_cache_entry_t*
+desc_cache_set_serial(desc_cache_entry_t *entry, const char *serial, size_t len)
+{
+   desc_cache_entry_t *e;
+
+   if (!entry) {
+      return NULL;
+   }
+
+   len = min_t(size_t, len, MAX_SIZE_SERIAL);
+
+   mutex_lock(&desc_cache_state.lock);
+   if (entry->serial_len == len && !memcmp(entry->serial, serial, len)) {
+      goto end;
+   }
+
+   list_for_each_entry(e, &desc_cache_state.entries, list) {
+      if (e != entry && same_device(&e->identity.device, &entry->identity.device) &&
+          e->serial_len == len && !memcmp(e->serial, serial, len)) {
+         log(INFO,"Switch to cache entry of serial");
+         goto switch_entry;
+      }
+   }
+
+   if (entry->serial_len == 0) {
+      memcpy(entry->serial, serial, len);
+      entry->serial_len = len;
+      goto end;
+   }
+
+   // Same model, other physical device
+   e = alloc_entry(&entry->identity);
+   if (!e) {
+      goto end;
+   }
+   memcpy(e->serial, serial, len);
+   e->serial_len = len;
+
+ switch_entry:
+   list_move(&e->list, &desc_cache_state.entries);
+   e->users++;
+   entry->users--;
+   entry = e;
+ end:
+   mutex_unlock(&desc_cache_state.lock);
+   return entry;
+}
+
+int
+desc_cache_init(void)
+{
+   mutex_init(&desc_cache_state.lock);
+   INIT_LIST_HEAD(&desc_cache_state.entries);
+   desc_cache_state.nb_entries = 0;
+   return 0;
+}
+
+void
+desc_cache_exit(void)
+{
+   desc_cache_entry_t *entry, *tmp;
+
+   list_for_each_entry_safe(entry, tmp, &desc_cache_state.entries, list) {
+      list_del(&entry->list);
+      flush_responses(entry);
+      kfree(entry);
+   }
+   desc_cache_state.nb_entries = 0;
+}
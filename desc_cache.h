@@ -0,0 +1,26 @@
+#ifndef __UBQ_DESC_CACHE_H
+#define __UBQ_DESC_CACHE_H
+
+#include <linux/usb/ch9.h>
+#include "types.h"
+
+/*
+ * LRU cache of device identities and their GET_DESCRIPTOR responses
+ * Keyed by idVendor/idProduct/bcdDevice and serial string once known
+ */
+typedef struct desc_cache_entry_t desc_cache_entry_t;
+
+int desc_cache_enabled(void);
+
+desc_cache_entry_t* desc_cache_get(const identity_t *identity);
+void desc_cache_put(desc_cache_entry_t *entry);
+
+int desc_cache_lookup(desc_cache_entry_t *entry, const struct usb_ctrlrequest *ctrl, char *buf, size_t *len);
+int desc_cache_store(desc_cache_entry_t *entry, const struct usb_ctrlrequest *ctrl, const char *buf, size_t len);
+void desc_cache_forget(desc_cache_entry_t *entry, const struct usb_ctrlrequest *ctrl);
+desc_cache_entry_t* desc_cache_set_serial(desc_cache_entry_t *entry, const char *serial, size_t len);
+
+int desc_cache_init(void);
+void desc_cache_exit(void);
+
+#endif
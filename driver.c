@@ -4,6 +4,7 @@
 #include <linux/usb/ch9.h>			/* USB stuff */
 #include <linux/usb/hcd.h>
 #include <linux/workqueue.h>
+#include <linux/mutex.h>
 #include <linux/inet.h> /* in4_pton */
 
 #include "util.h"
@@ -14,6 +15,7 @@
 #include "debug.h"
 #include "debug_usb.h"
 #include "common.h"
+#include "bench.h"
 
 
 #ifndef CONFIG_DRIVER_DEBUG_LEVEL
@@ -45,7 +47,17 @@
 #endif
 
 #define SERVER_IP               "192.168.64.1"
-#define SERVER_PORT             64240
+#define SERVER_PORT             64240 // Device i from SERVER_PORT+i*COM_INSTANCE_PORTS
+#define DRIVER_MAX_DEVICES      4
+
+static int reset_on_reload = 0;
+module_param(reset_on_reload, int, 0644);
+MODULE_PARM_DESC(reset_on_reload, "Reset physical device before announcing it again on RELOAD");
+
+static char *match[DRIVER_MAX_DEVICES];
+static int nb_match = 0;
+module_param_array(match, charp, &nb_match, 0444);
+MODULE_PARM_DESC(match, "Devices to relay, one channel each: vid:pid[:port] in hex, * for any, port as in sysfs (1-1.2). Default: first device");
 
 #define NB_ISOC_PKTS 1
 #define ISOC_PKTS(wMaxPacketSize) ((le16_to_cpu((wMaxPacketSize))>>11)+1)
@@ -63,22 +75,41 @@ typedef struct driver_request_t {
    struct urb *urb;
    driver_endpoint_t *ep;
    struct list_head list;
+   int cancelled; // Killed by endpoint teardown, reqlist_lock held
+   u32 gen; // Completion order of interrupt IN reports (latest value policy)
 } driver_request_t;
 
-static struct driver_state_t {
+/*
+  One context per relayed device, with its own channel
+*/
+typedef struct driver_ctx_t {
+   int idx;
+   const char *match; // Rule of devices it takes, NULL for any
    int init;
+   int paused; // RESET received from userland, wait for RELOAD
+   int resetting; // Reset started by RELOAD, which announces the device itself
    struct usb_device                *dev;
+   struct usb_interface             *interface;
    com_t *com;
    struct list_head eplist;
+} driver_ctx_t;
+
+static struct driver_state_t {
+   struct mutex lock; // Binding of devices to contexts
+   int nb_ctx;
+   driver_ctx_t ctx[DRIVER_MAX_DEVICES];
 } driver_state;
 
+#define EP_CTX(ep) ((driver_ctx_t *)((ep_t *)(ep))->ctx)
+
 
 static void driver_disconnect(struct usb_interface *interface);
+static void send_reset(driver_ctx_t *ctx);
 
 static void free_driver_request(driver_request_t *req);
 
 static void
-clean_endpoints(void);
+clean_endpoints(driver_ctx_t *ctx);
 /*-------------------------------------------------------------------------*/
 
 int ep_driver_send_usb(driver_endpoint_t *ep, msg_t *msg);
@@ -98,10 +129,10 @@ driver_request_t* ep_driver_fill_int_request(driver_endpoint_t *ep, msg_t *msg);
 driver_request_t* ep_driver_fill_bulk_request(driver_endpoint_t *ep, msg_t *msg);
 
 void ep_free_driver_request(driver_endpoint_t *ep, driver_request_t *req);
-int driver_recv_userland_management(msg_t *msg);
+int driver_recv_userland_management(driver_ctx_t *ctx, msg_t *msg);
 
-void ubq_disable_device(void);
-int ubq_enable_device(void);
+void ubq_disable_device(driver_ctx_t *ctx);
+int ubq_enable_device(driver_ctx_t *ctx);
 
 /*-------------------------------------------------------------------------*/
 
@@ -141,13 +172,13 @@ static cb_conf_t driver_cb_conf = {
 };
 
 void
-dump_active_driver_endpoints(void)
+dump_active_driver_endpoints(driver_ctx_t *ctx)
 {
    ep_t *ep;
    int i = 0;
 
-   log(SPEC,"Active driver endpoints");
-   list_for_each_entry(ep,&driver_state.eplist,list) {
+   log(SPEC,"Active driver endpoints of device %d",ctx->idx);
+   list_for_each_entry(ep,&ctx->eplist,list) {
       log(SPEC,"%u : %s",i,dump_usb_endpoint_descriptor(ep->desc));
       i++;
    }
@@ -179,7 +210,7 @@ urb_submit(driver_request_t *req)
  *
  -------------------------------------------------------------------------*/
 driver_endpoint_t*
-add_driver_ep0_endpoint(epdir_t epdir)
+add_driver_ep0_endpoint(driver_ctx_t *ctx, epdir_t epdir)
 {
    int err;
    driver_endpoint_t *ep;
@@ -194,7 +225,8 @@ add_driver_ep0_endpoint(epdir_t epdir)
       goto fail2;
    }
 
-   list_add(&ep->list,&driver_state.eplist);
+   ep->ctx = ctx;
+   ep_list_add((ep_t *)ep,&ctx->eplist);
 
    return ep;
 
@@ -206,7 +238,7 @@ add_driver_ep0_endpoint(epdir_t epdir)
 }
 
 driver_endpoint_t*
-add_driver_endpoint(struct usb_endpoint_descriptor *epdesc)
+add_driver_endpoint(driver_ctx_t *ctx, struct usb_endpoint_descriptor *epdesc)
 {
    int err;
    driver_endpoint_t *ep;
@@ -223,7 +255,8 @@ add_driver_endpoint(struct usb_endpoint_descriptor *epdesc)
       goto fail2;
    }
 
-   list_add(&ep->list,&driver_state.eplist);
+   ep->ctx = ctx;
+   ep_list_add((ep_t *)ep,&ctx->eplist);
 
    return ep;
 
@@ -235,29 +268,38 @@ add_driver_endpoint(struct usb_endpoint_descriptor *epdesc)
 }
 
 
-/*
- * Cancel a request, will be freed insite completion
- */
-void
-cancel_driver_request(driver_request_t *req)
-{
-   log(DBG,"Cancel driver request epid:[%s]",dump_endpoint_id(&req->ep->epid));
-   usb_kill_urb(req->urb);
-}
-
-
 void
 free_driver_endpoint(driver_endpoint_t *ep)
 {
-   driver_request_t *req, *tmp;
+   driver_request_t *req;
+   unsigned long flags;
    log(SPEC,"Free driver endpoint ep:[%s]",dump_endpoint_id(&ep->epid));
 
    // Remove from list
-   list_del(&ep->list);
+   ep_list_del((ep_t *)ep);
 
    // Cancel all requests, will be freed inside completion handler
-   list_for_each_entry_safe(req, tmp, &ep->reqlist, list) {
-      cancel_driver_request(req);
+   // Poisoning sleeps and completion may free from under us, URB is held meanwhile
+   // Poisoned URBs also fail resubmission, from completion or workqueue
+   for (;;) {
+      struct urb *urb = NULL;
+
+      spin_lock_irqsave(&ep->reqlist_lock,flags);
+      list_for_each_entry(req, &ep->reqlist, list) {
+         if (!req->cancelled) {
+            req->cancelled = 1;
+            urb = usb_get_urb(req->urb);
+            log(DBG,"Cancel driver request epid:[%s]",dump_endpoint_id(&ep->epid));
+            break;
+         }
+      }
+      spin_unlock_irqrestore(&ep->reqlist_lock,flags);
+
+      if (!urb) {
+         break;
+      }
+      usb_poison_urb(urb);
+      usb_put_urb(urb);
    }
 
    //usb_reset_endpoint(driver_state.dev,ep->desc->bEndpointAddress);
@@ -266,9 +308,9 @@ free_driver_endpoint(driver_endpoint_t *ep)
 }
 
 driver_endpoint_t*
-find_driver_endpoint(const epid_t *id)
+find_driver_endpoint(driver_ctx_t *ctx, const epid_t *id)
 {
-   return (driver_endpoint_t *)find_endpoint(id, &driver_state.eplist);
+   return (driver_endpoint_t *)find_endpoint(id, &ctx->eplist);
 }
 
 /*-------------------------------------------------------------------------
@@ -282,6 +324,7 @@ alloc_driver_request(driver_endpoint_t *ep, const size_t sz)
    driver_request_t *req;
    uint nb_packets = 0;
    size_t size = sz;
+   unsigned long flags;
 
    log(DBG,"Allocate driver request ep:[%s] sz:%u",dump_endpoint_id(&ep->epid),sz);
 
@@ -310,7 +353,10 @@ alloc_driver_request(driver_endpoint_t *ep, const size_t sz)
       goto fail3;
    }
 
+   req->cancelled = 0;
+   spin_lock_irqsave(&ep->reqlist_lock,flags);
    list_add(&req->list,&ep->reqlist);
+   spin_unlock_irqrestore(&ep->reqlist_lock,flags);
 
    msg_set_epid(req->msg, &ep->epid);
    req->ep = ep;
@@ -327,8 +373,12 @@ alloc_driver_request(driver_endpoint_t *ep, const size_t sz)
 static void
 free_driver_request(driver_request_t *req)
 {
+   unsigned long flags;
+
    log(DBG,"Free driver epid:[%s]",dump_endpoint_id(&req->ep->epid));
+   spin_lock_irqsave(&req->ep->reqlist_lock,flags);
    list_del(&req->list);
+   spin_unlock_irqrestore(&req->ep->reqlist_lock,flags);
 
    usb_free_urb(req->urb);
 
@@ -337,8 +387,30 @@ free_driver_request(driver_request_t *req)
 }
 
 
+/*
+  Is this endpoint part of the interface, with the same descriptor
+ */
+static int
+endpoint_in_interface(const struct usb_endpoint_descriptor *desc, const struct usb_host_interface *interface)
+{
+   int ep;
+
+   if (!interface) {
+      return 0;
+   }
+   for (ep=0; ep<interface->desc.bNumEndpoints; ep++) {
+      if (!memcmp(&interface->endpoint[ep].desc, desc, sizeof *desc)) {
+         return 1;
+      }
+   }
+   return 0;
+}
+
+/*
+  Endpoints also present in keep are left untouched
+ */
 int
-disable_driver_interface(struct usb_host_interface *interface)
+disable_driver_interface(driver_ctx_t *ctx, struct usb_host_interface *interface, struct usb_host_interface *keep)
 {
    int ep;
 
@@ -351,7 +423,12 @@ disable_driver_interface(struct usb_host_interface *interface)
                      EP_DIR_FROM_KERNEL(desc->bEndpointAddress & USB_ENDPOINT_DIR_MASK)};
       driver_endpoint_t *ep;
 
-      ep = find_driver_endpoint(&epid);
+      if (endpoint_in_interface(desc, keep)) {
+         log(DBG,"Keeping endpoint epid:[%s]",dump_endpoint_id(&epid));
+         continue;
+      }
+
+      ep = find_driver_endpoint(ctx, &epid);
       if (ep) {
          log(DBG,"Disabling endpoint epid:[%s]",dump_endpoint_id(&epid));
          free_driver_endpoint(ep);
@@ -362,7 +439,7 @@ disable_driver_interface(struct usb_host_interface *interface)
 
 
 int
-enable_driver_interface(struct usb_host_interface *interface)
+enable_driver_interface(driver_ctx_t *ctx, struct usb_host_interface *interface)
 {
    int ep;
 
@@ -370,23 +447,39 @@ enable_driver_interface(struct usb_host_interface *interface)
 
    for (ep=0; ep<interface->desc.bNumEndpoints; ep++) {
       struct usb_endpoint_descriptor *epdesc = &interface->endpoint[ep].desc;
+      epid_t epid = {epdesc->bEndpointAddress & USB_ENDPOINT_NUMBER_MASK,
+                     EP_TYPE_FROM_KERNEL(epdesc->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK),
+                     EP_DIR_FROM_KERNEL(epdesc->bEndpointAddress & USB_ENDPOINT_DIR_MASK)};
       driver_endpoint_t *epnew;
 
-      epnew = add_driver_endpoint(epdesc);
+      epnew = find_driver_endpoint(ctx, &epid);
+      if (epnew) {
+         if (!memcmp(epnew->desc, epdesc, sizeof *epdesc)) {
+            log(DBG,"Endpoint already enabled epid:[%s]",dump_endpoint_id(&epid));
+            continue;
+         }
+         free_driver_endpoint(epnew);
+      }
+
+      epnew = add_driver_endpoint(ctx, epdesc);
       if(!epnew) {
          log(ERR,"Unable to add endpoint %u type:%s dir:%s",
+             epdesc->bEndpointAddress,
              EP_TYPE_STR(EP_TYPE_FROM_KERNEL(epdesc->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK)),
              EP_DIR_STR(EP_DIR_FROM_KERNEL(epdesc->bEndpointAddress & USB_ENDPOINT_DIR_MASK)));
          return -ENOMEM;
       }
 
-      // Wait for driver communication if IN
+      // Wait for driver communication if IN, as many URBs as one ACK may stand for
       if (IS_IN(epnew) && !IS_CTRL(epnew)) {
          int err;
-         err = epnew->ops->send_usb(epnew, NULL);
-         if (err<0) {
-            log(ERR,"Unable to send USB for receiving IN [%d] epid:[%s]",err,dump_endpoint_id(&epnew->epid));
-            return err;
+         int i;
+         for (i=0; i<ack_window_size(); i++) {
+            err = epnew->ops->send_usb(epnew, NULL);
+            if (err<0) {
+               log(ERR,"Unable to send USB for receiving IN [%d] epid:[%s]",err,dump_endpoint_id(&epnew->epid));
+               return err;
+            }
          }
       }
    }
@@ -394,43 +487,48 @@ enable_driver_interface(struct usb_host_interface *interface)
    return 0;
 }
 
-int
-disable_active_driver_interface(void)
+/*
+  Is this endpoint used by the current altsetting of an interface
+ */
+static int
+endpoint_in_current_config(driver_ctx_t *ctx, const struct usb_endpoint_descriptor *desc)
 {
-   struct usb_host_config *config = driver_state.dev->actconfig; // XXX TODO not necessary the first one
+   struct usb_host_config *config = ctx->dev->actconfig; // XXX TODO not necessary the first one
    int i;
 
-   // In fact, we do not have information on the active interface
-   // We disable everything
    for (i=0; i<config->desc.bNumInterfaces; i++) {
-      struct usb_interface *iface = config->interface[i];
-      int j;
-
-      for (j=0;j<iface->num_altsetting;j++) {
-         struct usb_host_interface *intf = &iface->altsetting[j];
-         int err;
-
-         err = disable_driver_interface(intf);
-         if (err<0) {
-            log(ERR,"Unable to enable interface [%d]",err);
-            return err;
-         }
+      if (endpoint_in_interface(desc, config->interface[i]->cur_altsetting)) {
+         return 1;
       }
    }
    return 0;
 }
 
+/*
+  Bring endpoints in line with the current altsetting of every interface
+  Only endpoints which are not used anymore are freed, and only missing ones are created
+ */
 int
-enable_default_driver_interface(void)
+sync_driver_interfaces(driver_ctx_t *ctx)
 {
-   struct usb_host_config *config = driver_state.dev->actconfig; // XXX TODO not necessary the first one
+   struct usb_host_config *config = ctx->dev->actconfig; // XXX TODO not necessary the first one
+   ep_t *ep, *tmp;
    int i;
 
+   // In fact, we do not have information on the active interface
+   // Every endpoint not in a current altsetting is disabled
+   list_for_each_entry_safe(ep, tmp, &ctx->eplist, list) {
+      if (ep->epid.num != 0 && !endpoint_in_current_config(ctx, ep->desc)) {
+         log(DBG,"Disabling endpoint epid:[%s]",dump_endpoint_id(&ep->epid));
+         free_driver_endpoint((driver_endpoint_t *)ep);
+      }
+   }
+
    for (i=0; i<config->desc.bNumInterfaces; i++) {
       struct usb_host_interface *iface = config->interface[i]->cur_altsetting;
       int err;
 
-      err = enable_driver_interface(iface);
+      err = enable_driver_interface(ctx, iface);
       if (err<0) {
          log(ERR,"Unable to enable interface [%d]",err);
          return err;
@@ -440,29 +538,31 @@ enable_default_driver_interface(void)
 }
 
 int
-set_driver_interface(ushort ifnumber, ushort alternative)
+set_driver_interface(driver_ctx_t *ctx, ushort ifnumber, ushort alternative)
 {
    int err = 0;
-   struct usb_interface *interface = usb_ifnum_to_if(driver_state.dev,ifnumber);
+   struct usb_interface *interface = usb_ifnum_to_if(ctx->dev,ifnumber);
    struct usb_host_interface *old = interface->cur_altsetting;
    struct usb_host_interface *new = usb_altnum_to_altsetting(interface, alternative);
 
    log(INFO,"Set interface [%u,%u]",ifnumber,alternative);
 
    // Do the usb communication and structure modifications
-   err = usb_set_interface(driver_state.dev,ifnumber,alternative);
+   err = usb_set_interface(ctx->dev,ifnumber,alternative);
    if (err < 0) {
       log(ERR,"Unable to set interface [%d]",err);
       return err;
    }
 
-   err = disable_driver_interface(old);
+   // usb_set_interface has already flushed every endpoint of old altsetting,
+   // so nothing can be kept here
+   err = disable_driver_interface(ctx, old, NULL);
    if (err != 0) {
       log(WRN,"Unable to disable interface");
       return err;
    }
 
-   err = enable_driver_interface(new);
+   err = enable_driver_interface(ctx, new);
    if (err != 0) {
       log(WRN,"Unable to enable interface");
       return err;
@@ -481,17 +581,17 @@ set_driver_interface(ushort ifnumber, ushort alternative)
 uint
 get_pipe(driver_endpoint_t *ep) {
    if (IS_CTRL(ep)) {
-      return IS_IN(ep) ? usb_rcvctrlpipe(driver_state.dev,ep->epid.num)
-                       : usb_sndctrlpipe(driver_state.dev,ep->epid.num);
+      return IS_IN(ep) ? usb_rcvctrlpipe(EP_CTX(ep)->dev,ep->epid.num)
+                       : usb_sndctrlpipe(EP_CTX(ep)->dev,ep->epid.num);
    } else if (IS_INTERRUPT(ep)) {
-      return IS_IN(ep) ? usb_rcvintpipe(driver_state.dev,ep->epid.num)
-                       : usb_sndintpipe(driver_state.dev,ep->epid.num);
+      return IS_IN(ep) ? usb_rcvintpipe(EP_CTX(ep)->dev,ep->epid.num)
+                       : usb_sndintpipe(EP_CTX(ep)->dev,ep->epid.num);
    } else if (IS_BULK(ep)) {
-      return IS_IN(ep) ? usb_rcvbulkpipe(driver_state.dev,ep->epid.num)
-                       : usb_sndbulkpipe(driver_state.dev,ep->epid.num);
+      return IS_IN(ep) ? usb_rcvbulkpipe(EP_CTX(ep)->dev,ep->epid.num)
+                       : usb_sndbulkpipe(EP_CTX(ep)->dev,ep->epid.num);
    } else { // ISOC
-      return IS_IN(ep) ? usb_rcvisocpipe(driver_state.dev,ep->epid.num)
-                       : usb_rcvisocpipe(driver_state.dev,ep->epid.num);
+      return IS_IN(ep) ? usb_rcvisocpipe(EP_CTX(ep)->dev,ep->epid.num)
+                       : usb_rcvisocpipe(EP_CTX(ep)->dev,ep->epid.num);
    }
 }
 
@@ -499,7 +599,36 @@ int
 ep_clear_halt(driver_endpoint_t *ep)
 {
    log(INFO,"Clear halt epid:[%s]",dump_endpoint_id(&ep->epid));
-   return usb_clear_halt(driver_state.dev,get_pipe(ep));
+   return usb_clear_halt(EP_CTX(ep)->dev,get_pipe(ep));
+}
+
+static int
+grant_peer_credit(driver_endpoint_t *ep)
+{
+   msg_t *m;
+   int err;
+
+   m = alloc_msg_credit(&ep->epid, 1);
+   if (!m) {
+      log(ERR,"Unable to allocate memory");
+      return -ENOMEM;
+   }
+   err = send_userland(EP_CTX(ep)->com, m);
+   free_msg(m);
+   return err;
+}
+
+/*
+  Refill IN endpoint, unless peer has no more room
+*/
+static int
+refill_in(driver_endpoint_t *ep)
+{
+   if (!ep_take_credit((ep_t *)ep)) {
+      log(DBG,"No more credits, holding IN endpoint [%s]",dump_endpoint_id(&ep->epid));
+      return 0;
+   }
+   return ep->ops->send_usb(ep, NULL);
 }
 
 /*
@@ -553,6 +682,59 @@ recv(struct work_struct *data)
       log(WRN,"URB Status [%d] epid:[%s] urb:[%s]", urb->status, dump_endpoint_id(&ep->epid),dump_urb(urb));
    }
 
+   // OUT data is out of the way, peer may send more
+   if (IS_OUT(ep) && !IS_CTRL(ep) && flow_control_enabled()) {
+      err = grant_peer_credit(ep);
+      if (err<0) {
+         log(ERR,"Unable to grant credit [%d] epid:[%s]",err,dump_endpoint_id(&ep->epid));
+      }
+   }
+
+   ep->ops->free_request(ep, req);
+}
+
+/*
+  Successful IN transfer, in completion context
+  URB is resubmitted as is when a refill is due, freed otherwise
+*/
+static void
+recv_fast(driver_request_t *req)
+{
+   driver_endpoint_t *ep = req->ep;
+   struct urb *urb = req->urb;
+   int err;
+
+   msg_set_data_size(req->msg, urb->actual_length);
+
+   // Nothing to forward, same as asking next IN
+   if (ep_latest_enabled(ep) && ep_latest_superseded(ep, req->gen)) {
+      bench_count(BENCH_DRIVER_INT_SUPERSEDED);
+      goto resubmit;
+   }
+   if (IS_ISOCHRONOUS(ep) && urb->actual_length == 0) {
+      goto resubmit;
+   }
+
+   err = ep->ops->send_userland(ep, req->msg);
+   if (err<0) {
+      log(ERR,"Unable to send userland [%d] epid:[%s]",err,dump_endpoint_id(&ep->epid));
+      goto free;
+   }
+
+   // Isoc and, without flow control, every IN waits for the ACK
+   if (IS_ISOCHRONOUS(ep) || !flow_control_enabled() || !ep_take_credit((ep_t *)ep)) {
+      goto free;
+   }
+
+ resubmit:
+   err = usb_submit_urb(urb, GFP_ATOMIC);
+   if (err<0) {
+      log(ERR,"Unable to resubmit URB [%d] epid:[%s]",err,dump_endpoint_id(&ep->epid));
+      goto free;
+   }
+   return;
+
+ free:
    ep->ops->free_request(ep, req);
 }
 
@@ -562,9 +744,19 @@ driver_recv_usb(struct urb *urb)
    int err;
    driver_request_t *req = (driver_request_t *)urb->context;
 
+   if (ep_latest_enabled(req->ep)) {
+      req->gen = ep_latest_stamp(req->ep);
+   }
+
+   // Workqueue is left for errors, control and OUT completions
+   if (urb->status == 0 && IS_IN(req->ep) && ep_fast_path((ep_t *)req->ep, EP_CTX(req->ep)->com, req->msg)) {
+      recv_fast(req);
+      return;
+   }
+
    INIT_WORK(&req->work, &recv);
 
-   err = queue_work(req->ep->wq, &req->work);
+   err = ep_queue_work((ep_t *)req->ep, &req->work);
    if(err < 0) {
       log(WRN,"Unable to queue work");
    }
@@ -572,12 +764,12 @@ driver_recv_usb(struct urb *urb)
 
 
 int
-driver_recv_userland_usb(msg_t *msg)
+driver_recv_userland_usb(driver_ctx_t *ctx, msg_t *msg)
 {
    int err;
    driver_endpoint_t *ep;
 
-   ep = find_driver_endpoint(&msg->epid);
+   ep = find_driver_endpoint(ctx, &msg->epid);
    if (!ep) {
       log(ERR,"Unable to find endpoint epid:[%s]",dump_endpoint_id(&msg->epid));
       return -EINVAL;
@@ -585,7 +777,7 @@ driver_recv_userland_usb(msg_t *msg)
 
    log_msg(DBG,msg,"UDP -- RECV epid:[%s]",dump_endpoint_id(&ep->epid));
 
-   err = ep->ops->recv_userland(ep, msg);
+   err = ep_recv_userland((ep_t *)ep, msg);
    if (err<0) {
       log(ERR,"Unable to recv from userland [%d] epid:[%s]",err,dump_endpoint_id(&ep->epid));
       return err;
@@ -594,18 +786,28 @@ driver_recv_userland_usb(msg_t *msg)
    return 0;
 }
 
+struct list_head*
+driver_peer_endpoints(int idx)
+{
+   if (idx >= driver_state.nb_ctx || !driver_state.ctx[idx].dev) {
+      return NULL;
+   }
+   return &driver_state.ctx[idx].eplist;
+}
+
 int
-driver_recv_userland(msg_t *msg)
+driver_recv_userland(com_t *com, msg_t *msg)
 {
+   driver_ctx_t *ctx = (driver_ctx_t *)com->priv;
    int err;
    if (IS_USB_MSG(msg)) {
-      err = driver_recv_userland_usb(msg);
+      err = driver_recv_userland_usb(ctx, msg);
       if (err<0) {
          log(ERR,"Unable to recv userland usb [%d]",err);
          return err;
       }
    } else if (IS_MANAGEMENT_MSG(msg)) {
-      err = driver_recv_userland_management(msg);
+      err = driver_recv_userland_management(ctx, msg);
       if (err<0) {
          log(ERR,"Unable to recv userland management [%d]",err);
          return err;
@@ -628,7 +830,12 @@ ep_driver_send_userland(driver_endpoint_t *ep, msg_t *msg)
 {
    int err;
    log_msg(DBG,msg,"UDP -- SEND epid:[%s]",dump_endpoint_id(&ep->epid));
-   err = send_userland(driver_state.com, msg);
+   // Gadget forwards it itself if userland is late, request msg may carry an old tag
+   msg->tag = 0;
+   if (ep_deadline_enabled((ep_t *)ep, EP_CTX(ep)->com, msg)) {
+      ep_verdict_expect(gadget_peer_endpoints(EP_CTX(ep)->idx), msg);
+   }
+   err = send_userland(EP_CTX(ep)->com, msg);
    if (err<0) {
       log(ERR,"Unable to send userland [%d] epid:[%s]",err,dump_endpoint_id(&ep->epid));
       return err;
@@ -654,7 +861,7 @@ ep_driver_recv_userland_ctrl(driver_endpoint_t *ep, msg_t *msg)
       }
 
       // Will send the packet, so no send_usb
-      ret = set_driver_interface(ctrl->wIndex,ctrl->wValue);
+      ret = set_driver_interface(EP_CTX(ep),ctrl->wIndex,ctrl->wValue);
       if (ret < 0) {
          log(ERR,"Unable to set interface [%d]",ret);
          free_msg(m);
@@ -690,13 +897,28 @@ ep_driver_recv_userland(driver_endpoint_t *ep, msg_t *msg)
    int err;
 
    if(IS_USB_ACK(msg)) {
-      // resubmit for IN
+      u32 n = min_t(u32, ack_count(msg), ack_window_size());
+      u32 i;
+
+      // resubmit for IN, once per request consumed
       assert(IS_IN(ep));
 
-      err = ep->ops->send_usb(ep, NULL);
-      if (err<0) {
-         log(ERR,"Unable to send USB to get IN [%d] epid:[%s]",err,dump_endpoint_id(&ep->epid));
-         return err;
+      // Peer may have lost track of last payload, next one goes as is
+      if (msg->status < 0) {
+         ep_delta_reset((ep_t *)ep);
+      }
+
+      for (i=0; i<n; i++) {
+         if (flow_control_enabled() && !ep_grant_credits((ep_t *)ep, 1)) {
+            // Refill was not held back
+            continue;
+         }
+
+         err = ep->ops->send_usb(ep, NULL);
+         if (err<0) {
+            log(ERR,"Unable to send USB to get IN [%d] epid:[%s]",err,dump_endpoint_id(&ep->epid));
+            return err;
+         }
       }
    } else {
       // Send OUT data
@@ -765,15 +987,9 @@ ep_driver_recv_usb_ctrl(driver_endpoint_t *ep, driver_request_t *req)
    } else {
       if (epid->num == 0) {
          if (IS_SET_CONFIGURATION(ctrl)) {
-            ret = disable_active_driver_interface();
+            ret = sync_driver_interfaces(EP_CTX(ep));
             if (ret<0) {
-               log(ERR,"Unable to disable active interface [%s]",ret);
-               return ret;
-            }
-
-            ret = enable_default_driver_interface();
-            if (ret<0) {
-               log(ERR,"Unable to enable default interface [%s]",ret);
+               log(ERR,"Unable to sync interfaces [%d]",ret);
                return ret;
             }
          }
@@ -819,11 +1035,36 @@ ep_driver_recv_usb(driver_endpoint_t *ep, driver_request_t *req)
    log_msg(DBG,req->msg,"URB ++ RECV (%s) (status:%d) (actual_length:%u)", dump_endpoint_id(&req->ep->epid),req->urb->status, req->urb->actual_length);
 
    if(ep->epid.dir == IN) {
-      err = ep->ops->send_userland(ep, req->msg);
+      msg_t *delta;
+
+      // A newer report is on its way, this one will never be ACKed
+      if (ep_latest_enabled(ep) && ep_latest_superseded(ep, req->gen)) {
+         log(DBG,"Report superseded epid:[%s]",dump_endpoint_id(&ep->epid));
+         bench_count(BENCH_DRIVER_INT_SUPERSEDED);
+         return ep->ops->send_usb(ep, NULL);
+      }
+
+      delta = ep_delta_encode((ep_t *)ep, req->msg);
+
+      err = ep->ops->send_userland(ep, delta ? delta : req->msg);
+      if (delta) {
+         free_msg(delta);
+      }
       if (err<0) {
          log(ERR,"Unable to send userland [%d] epid:[%s]",err,dump_endpoint_id(&ep->epid));
          return err;
       }
+      // Peer base only moves with what it received
+      ep_delta_commit((ep_t *)ep, req->msg);
+
+      // Without flow control, next IN is asked when ACK comes back
+      if (flow_control_enabled()) {
+         err = refill_in(ep);
+         if (err<0) {
+            log(ERR,"Unable to refill IN [%d] epid:[%s]",err,dump_endpoint_id(&ep->epid));
+            return err;
+         }
+      }
    }
 
    return 0;
@@ -907,7 +1148,7 @@ ep_driver_fill_ctrl_request(driver_endpoint_t *ep, msg_t *msg)
    msgcpy(req->msg, msg->data, msg_get_data_size(msg));
 
    usb_fill_control_urb(req->urb,
-                        driver_state.dev,
+                        EP_CTX(ep)->dev,
                         get_pipe(ep),
                         (unsigned char *)req->msg->data,
                         req->msg->data + sizeof *ctrl,
@@ -950,7 +1191,7 @@ ep_driver_fill_int_request(driver_endpoint_t *ep, msg_t *msg)
    }
 
    usb_fill_int_urb(req->urb,
-                    driver_state.dev,
+                    EP_CTX(ep)->dev,
                     get_pipe(ep),
                     req->msg->data,
                     sz,
@@ -995,7 +1236,7 @@ ep_driver_fill_bulk_request(driver_endpoint_t *ep, msg_t *msg)
 
 
    usb_fill_bulk_urb(req->urb,
-                     driver_state.dev,
+                     EP_CTX(ep)->dev,
                      get_pipe(ep),
                      req->msg->data,
                      sz,
@@ -1025,7 +1266,7 @@ ep_driver_fill_isoc_request(driver_endpoint_t *ep, msg_t *msg)
          log(ERR,"Unable to allocate request epid:[%s]",dump_endpoint_id(&ep->epid));
          return NULL;
       }
-      pipe = usb_rcvisocpipe(driver_state.dev,ep->epid.num);
+      pipe = usb_rcvisocpipe(EP_CTX(ep)->dev,ep->epid.num);
    } else {
       assert(IS_OUT(ep));
       req = alloc_driver_request(ep, msg_get_data_size(msg));
@@ -1036,13 +1277,13 @@ ep_driver_fill_isoc_request(driver_endpoint_t *ep, msg_t *msg)
       // Backup data after response
       msgcpy(req->msg, msg->data, msg_get_data_size(msg));
 
-      pipe = usb_sndisocpipe(driver_state.dev,ep->epid.num);
+      pipe = usb_sndisocpipe(EP_CTX(ep)->dev,ep->epid.num);
       sz = msg_get_data_size(req->msg);
    }
 
    urb = req->urb;
 
-   urb->dev = driver_state.dev;
+   urb->dev = EP_CTX(ep)->dev;
    urb->pipe = pipe;
    urb->transfer_flags = URB_ISO_ASAP;
    urb->transfer_buffer = req->msg->data;
@@ -1051,7 +1292,7 @@ ep_driver_fill_isoc_request(driver_endpoint_t *ep, msg_t *msg)
    urb->context = (void*)req;
    urb->start_frame = 0;
 
-   switch(driver_state.dev->speed) {
+   switch(EP_CTX(ep)->dev->speed) {
    case USB_SPEED_LOW:
    case USB_SPEED_FULL:
       urb->interval = ep->desc->bInterval;
@@ -1154,40 +1395,87 @@ static struct usb_device_id driver_table [] = {
 MODULE_DEVICE_TABLE (usb, driver_table);
 
 static int
-driver_probe(struct usb_interface *interface, const struct usb_device_id *id) {
-   int err = -ENODEV;
-   struct usb_device *dev = interface_to_usbdev(interface);
-   driver_endpoint_t *epin, *epout;
-   msg_t *msg;
+match_id(const char *field, u16 value)
+{
+   u16 v;
 
-   driver_state.dev = dev;
+   return !strcmp(field, "*") || (!kstrtou16(field, 16, &v) && v == value);
+}
 
-   log(SPEC,"SPEED: %u",dev->speed);
+/*
+  Rule is vid:pid[:port], port as named in sysfs (bus-port.port...)
+*/
+static int
+ctx_match(const driver_ctx_t *ctx, struct usb_device *dev)
+{
+   char vid[8], pid[8], port[32];
+   int n;
 
-   if(driver_state.init) {
+   if (!ctx->match) {
+      return 1;
+   }
+
+   n = sscanf(ctx->match, "%7[^:]:%7[^:]:%31s", vid, pid, port);
+   if (n < 2) {
+      log(WRN,"Bad match rule '%s' of device %d",ctx->match,ctx->idx);
       return 0;
    }
-   driver_state.init = 1;
+   return match_id(vid, le16_to_cpu(dev->descriptor.idVendor)) &&
+      match_id(pid, le16_to_cpu(dev->descriptor.idProduct)) &&
+      (n < 3 || !strcmp(port, "*") || !strcmp(port, dev_name(&dev->dev)));
+}
+
+// driver_state.lock held
+static driver_ctx_t*
+find_ctx(struct usb_device *dev)
+{
+   int i;
+
+   for (i=0; i<driver_state.nb_ctx; i++) {
+      if (driver_state.ctx[i].init && driver_state.ctx[i].dev == dev) {
+         return &driver_state.ctx[i];
+      }
+   }
+   return NULL;
+}
+
+/*
+ * Announce the claimed device to the gadget part: create ep0 and send
+ * the init packet. Used on probe and on RELOAD
+ */
+static int
+announce_device(driver_ctx_t *ctx)
+{
+   int err;
+   driver_endpoint_t *epin, *epout;
+   msg_t *msg;
+   u64 start;
+
+   bench_probe();
 
-   epin = add_driver_ep0_endpoint(IN);
+   epin = add_driver_ep0_endpoint(ctx, IN);
    if(!epin) {
       log(ERR,"Unable to add driver endpoint");
       return -ENOMEM;
    }
 
-   epout = add_driver_ep0_endpoint(OUT);
+   epout = add_driver_ep0_endpoint(ctx, OUT);
    if(!epout) {
       log(ERR,"Unable to add driver endpoint");
-      /* FIXME: Free epin */
+      free_driver_endpoint(epin);
       return -ENOMEM;
    }
 
-   msg = build_init_pkt(interface);
+   start = bench_now();
+   msg = build_init_pkt(ctx->interface);
    if (!msg) {
       log(ERR,"Unable to build init msg");
+      clean_endpoints(ctx);
       return -ENOMEM;
    }
+   bench_add(BENCH_BUILD_INIT_PKT,start);
 
+   bench_transport_start();
    err = epin->ops->send_userland(epin, msg);
    free_msg(msg);
    if (err < 0) {
@@ -1198,22 +1486,138 @@ driver_probe(struct usb_interface *interface, const struct usb_device_id *id) {
    return 0;
 }
 
+static int
+driver_probe(struct usb_interface *interface, const struct usb_device_id *id) {
+   struct usb_device *dev = interface_to_usbdev(interface);
+   driver_ctx_t *ctx = NULL;
+   int i;
+
+   log(SPEC,"SPEED: %u",dev->speed);
+
+   mutex_lock(&driver_state.lock);
+   // Other interfaces of a relayed device
+   if (find_ctx(dev)) {
+      mutex_unlock(&driver_state.lock);
+      return 0;
+   }
+   for (i=0; i<driver_state.nb_ctx; i++) {
+      if (!driver_state.ctx[i].init && ctx_match(&driver_state.ctx[i], dev)) {
+         ctx = &driver_state.ctx[i];
+         break;
+      }
+   }
+   if (!ctx) {
+      mutex_unlock(&driver_state.lock);
+      log(INFO,"No channel left for %04x:%04x [%s]",le16_to_cpu(dev->descriptor.idVendor),le16_to_cpu(dev->descriptor.idProduct),dev_name(&dev->dev));
+      return -ENODEV;
+   }
+   ctx->dev = dev;
+   ctx->interface = interface;
+   ctx->init = 1;
+   mutex_unlock(&driver_state.lock);
+
+   log(INFO,"Device %d is %04x:%04x [%s]",ctx->idx,le16_to_cpu(dev->descriptor.idVendor),le16_to_cpu(dev->descriptor.idProduct),dev_name(&dev->dev));
+
+   // Session stopped by userland, device will be announced on RELOAD
+   if (ctx->paused) {
+      log(INFO,"Session paused, device announce delayed");
+      return 0;
+   }
+
+   return announce_device(ctx);
+}
+
+/*
+  Do not let usb_reset_device unbind us
+  A reset of RELOAD is followed by its announce, any other one (usbfs, hub,
+  core) is seen by gadget as a disconnect then a new device
+*/
+static int
+driver_pre_reset(struct usb_interface *interface)
+{
+   driver_ctx_t *ctx;
+
+   mutex_lock(&driver_state.lock);
+   ctx = find_ctx(interface_to_usbdev(interface));
+   mutex_unlock(&driver_state.lock);
+
+   if (ctx) {
+      if (!ctx->resetting && !ctx->paused) {
+         log(INFO,"Device %d reset, gadget disconnected",ctx->idx);
+         send_reset(ctx);
+      }
+      clean_endpoints(ctx);
+   }
+   return 0;
+}
+
+static int
+driver_post_reset(struct usb_interface *interface)
+{
+   driver_ctx_t *ctx;
+   int err;
+
+   mutex_lock(&driver_state.lock);
+   ctx = find_ctx(interface_to_usbdev(interface));
+   mutex_unlock(&driver_state.lock);
+
+   if (!ctx || ctx->resetting || ctx->paused) {
+      return 0;
+   }
+
+   // Error unbinds us, device is then announced again on probe
+   err = announce_device(ctx);
+   if (err<0) {
+      log(ERR,"Unable to announce device %d after reset [%d]",ctx->idx,err);
+   }
+   return err;
+}
+
 static struct usb_driver ubq_driver = {
    .name = "ubq_driver",
    .id_table = driver_table,
    .probe = driver_probe,
    .disconnect = driver_disconnect,
+   .pre_reset = driver_pre_reset,
+   .post_reset = driver_post_reset,
 };
 
+/*
+  Credits granted by userland on top of ACKs
+*/
+static int
+driver_recv_credit(driver_ctx_t *ctx, msg_t *msg)
+{
+   credit_t *c = (credit_t *)msg->management_data;
+   driver_endpoint_t *ep;
+
+   ep = find_driver_endpoint(ctx, &c->epid);
+   if (!ep) {
+      log(DBG,"Credits for unknown endpoint epid:[%s]",dump_endpoint_id(&c->epid));
+      return 0;
+   }
+   if (ep_grant_credits((ep_t *)ep, le32_to_cpu(c->credits)) && IS_IN(ep)) {
+      return ep->ops->send_usb(ep, NULL);
+   }
+   return 0;
+}
+
 int
-driver_recv_userland_management(msg_t *msg)
+driver_recv_userland_management(driver_ctx_t *ctx, msg_t *msg)
 {
    log(DBG,"Management msg received: %u",msg->management_type);
-   if (IS_RESET_MNG_MSG(msg)) {
-      ubq_disable_device();
+   if (IS_CREDIT_MNG_MSG(msg)) {
+      int err;
+      err = driver_recv_credit(ctx, msg);
+      if (err<0) {
+         log(ERR,"Unable to handle credits [%d]",err);
+         return err;
+      }
+   } else if (IS_RESET_MNG_MSG(msg)) {
+      ubq_disable_device(ctx);
    } else if (IS_RELOAD_MNG_MSG(msg)) {
       int err;
-      err = ubq_enable_device();
+      err = ubq_enable_device(ctx);
       if (err<0) {
          log(ERR,"Unable to enable device");
          return err;
@@ -1226,94 +1630,178 @@ driver_recv_userland_management(msg_t *msg)
 }
 
 static void
-clean_endpoints(void)
+clean_endpoints(driver_ctx_t *ctx)
 {
    ep_t *ep, *tmp;
    // Free endpoints
-   list_for_each_entry_safe(ep, tmp, &driver_state.eplist, list) {
+   list_for_each_entry_safe(ep, tmp, &ctx->eplist, list) {
       free_driver_endpoint((driver_endpoint_t *)ep);
    }
 }
 
+/*
+  Specify to gadget that device has been disconnected
+*/
 static void
-driver_disconnect(struct usb_interface *interface)
+send_reset(driver_ctx_t *ctx)
 {
    msg_t *msg;
+   int err;
 
-   if(driver_state.init == 0) {
+   msg = alloc_msg_management(0);
+   if (!msg) {
+      log(ERR,"Unable to allocate msg");
       return;
    }
+   msg->management_type = RESET;
 
-   log(INFO,"DRIVER DISCONNECT");
+   err = send_userland(ctx->com, msg);
+   free_msg(msg);
+   if (err<0) {
+      log(ERR,"Unable to send to userland [%d]",err);
+   }
+}
 
-   // Specify to gadget that device has been disconnected
-   msg = alloc_msg_management(0);
-   if (!msg) {
-      log(ERR,"Unable to allocate msg");
-   } else {
-      int err;
-      msg->management_type = RESET;
+static void
+driver_disconnect(struct usb_interface *interface)
+{
+   driver_ctx_t *ctx;
 
-      err = send_userland(driver_state.com, msg);
-      free_msg(msg);
-      if (err<0) {
-         log(ERR,"Unable to send to userland [%d]",err);
-      }
+   mutex_lock(&driver_state.lock);
+   ctx = find_ctx(interface_to_usbdev(interface));
+   mutex_unlock(&driver_state.lock);
+   if (!ctx) {
+      return;
+   }
+
+   log(INFO,"DRIVER DISCONNECT device %d",ctx->idx);
+
+   // Specify to gadget that device has been disconnected
+   if (!ctx->paused) {
+      send_reset(ctx);
    }
 
-   clean_endpoints();
+   clean_endpoints(ctx);
 
-   driver_state.init = 0;
+   mutex_lock(&driver_state.lock);
+   ctx->interface = NULL;
+   ctx->dev = NULL;
+   ctx->init = 0;
+   mutex_unlock(&driver_state.lock);
 }
 
 /*
   Start communication with physical device
+  The driver stays registered, the claimed device is announced again
 */
 int
-ubq_enable_device(void)
+ubq_enable_device(driver_ctx_t *ctx)
 {
-   log(SPEC,"ENABLE DEVICE");
-   return usb_register(&ubq_driver);
+   int err;
+
+   log(SPEC,"ENABLE DEVICE %d",ctx->idx);
+
+   ctx->paused = 0;
+   if (!ctx->init) {
+      log(INFO,"No device claimed, waiting for probe");
+      return 0;
+   }
+
+   clean_endpoints(ctx);
+
+   if (reset_on_reload) {
+      err = usb_lock_device_for_reset(ctx->dev, ctx->interface);
+      if (err<0) {
+         log(ERR,"Unable to lock device for reset [%d]",err);
+         return err;
+      }
+      ctx->resetting = 1;
+      err = usb_reset_device(ctx->dev);
+      ctx->resetting = 0;
+      usb_unlock_device(ctx->dev);
+      if (err<0) {
+         log(ERR,"Unable to reset device [%d]",err);
+         return err;
+      }
+   }
+
+   return announce_device(ctx);
 }
 
 /*
   Stop communication with pysical device
 */
 void
-ubq_disable_device(void)
+ubq_disable_device(driver_ctx_t *ctx)
 {
-   log(SPEC,"DISABLE DEVICE");
-   clean_endpoints();
-   usb_deregister(&ubq_driver);
+   log(SPEC,"DISABLE DEVICE %d",ctx->idx);
+   if (ctx->init && !ctx->paused) {
+      send_reset(ctx);
+   }
+   ctx->paused = 1;
+   clean_endpoints(ctx);
 }
 
 
+static void
+close_channels(int nb)
+{
+   int i;
+
+   for (i=0; i<nb; i++) {
+      com_close(driver_state.ctx[i].com);
+   }
+}
+
 int
 ubq_driver_init(void)
 {
    int err;
-   udp_opt_t options;
+   int i;
    trace;
 
-   options.port = SERVER_PORT;
-   in4_pton(SERVER_IP,strlen(SERVER_IP),(u8*)&options.addr,'\0',NULL);
-   options.connect = 1;
-
-   INIT_LIST_HEAD(&driver_state.eplist);
-
-   driver_state.init = 0;
-
-   driver_state.com = com_init((void *)&options,driver_recv_userland,"DRIVER");
-   if (!driver_state.com) {
-      log(ERR,"Unable to initialise communication");
-      return -ENOMEM;
+   mutex_init(&driver_state.lock);
+   // Without rules, first device is taken
+   driver_state.nb_ctx = clamp(nb_match, 1, DRIVER_MAX_DEVICES);
+
+   for (i=0; i<driver_state.nb_ctx; i++) {
+      driver_ctx_t *ctx = &driver_state.ctx[i];
+      com_opt_t options;
+      char name[MAX_SIZE_ID];
+
+      options.channel = DRIVER_CHANNEL;
+      options.port = SERVER_PORT + i*COM_INSTANCE_PORTS;
+      in4_pton(SERVER_IP,strlen(SERVER_IP),(u8*)&options.addr,'\0',NULL);
+      options.connect = 1;
+      options.instance = i;
+
+      ctx->idx = i;
+      ctx->match = i < nb_match ? match[i] : NULL;
+      INIT_LIST_HEAD(&ctx->eplist);
+      ctx->init = 0;
+      ctx->paused = 0;
+      ctx->dev = NULL;
+      ctx->interface = NULL;
+
+      if (i == 0) {
+         snprintf(name, sizeof name, "DRIVER");
+      } else {
+         snprintf(name, sizeof name, "DRIVER%d", i);
+      }
+      ctx->com = com_init((void *)&options,driver_recv_userland,name,ctx);
+      if (IS_ERR(ctx->com)) {
+         err = PTR_ERR(ctx->com);
+         log(ERR,"Unable to initialise communication of device %d [%d]",i,err);
+         close_channels(i);
+         return err;
+      }
    }
 
    /* register this driver with the USB subsystem */
-   err = ubq_enable_device();
+   err = usb_register(&ubq_driver);
    if (err) {
       log(ERR,"usb_register failed. Error number %d", err);
-      com_close(driver_state.com);
+      close_channels(driver_state.nb_ctx);
       return err;
    }
    return 0;
@@ -1323,8 +1811,13 @@ ubq_driver_init(void)
 int
 ubq_driver_exit(void)
 {
-   ubq_disable_device();
-   com_close(driver_state.com);
+   int i;
+
+   for (i=0; i<driver_state.nb_ctx; i++) {
+      clean_endpoints(&driver_state.ctx[i]);
+   }
+   usb_deregister(&ubq_driver);
+   close_channels(driver_state.nb_ctx);
    log(INFO,"DRIVER_EXIT OK");
    return 0;
 }
@@ -12,7 +12,9 @@
 #include "msg.h"
 #include "com.h"
 #include "com_udp.h"
+#include "desc_cache.h"
 #include "gadget.h"
+#include "bench.h"
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,7,0)
 #include "epautoconf.c"
@@ -48,6 +50,15 @@
 
 #include "common.h"
 
+static int gadgets = 1;
+module_param(gadgets, int, 0444);
+MODULE_PARM_DESC(gadgets, "Gadget instances, each on its own UDC and channel, instance i shows driver device i");
+
+static char *udc[GADGET_MAX_DEVICES];
+static int nb_udc = 0;
+module_param_array(udc, charp, &nb_udc, 0444);
+MODULE_PARM_DESC(udc, "UDC of each instance, as named in /sys/class/udc (default: first free one)");
+
 
 /*-------------------------------------------------------------------------*/
 int
@@ -73,8 +84,41 @@ endpoint_queue(gadget_request_t *req)
  * Gadget endpoint management
  *
  -------------------------------------------------------------------------*/
+static void ack_timeout(struct work_struct *work);
+
+static void
+init_in_ack(gadget_endpoint_t *ep)
+{
+   spin_lock_init(&ep->ack_lock);
+   ep->ack_count = 0;
+   ep->ack_bytes = 0;
+   INIT_DELAYED_WORK(&ep->ack_work, ack_timeout);
+   ep->in_flight = 0;
+   ep->latest = NULL;
+}
+
+/*
+  Request of a latest value endpoint will not complete, forget waiting report
+*/
+static void
+latest_cancel(gadget_endpoint_t *ep)
+{
+   unsigned long flags;
+   msg_t *m;
+
+   spin_lock_irqsave(&ep->ack_lock,flags);
+   m = ep->latest;
+   ep->latest = NULL;
+   ep->in_flight = 0;
+   spin_unlock_irqrestore(&ep->ack_lock,flags);
+
+   if (m) {
+      free_msg(m);
+   }
+}
+
 gadget_endpoint_t*
-add_gadget_ep0_endpoint(epdir_t epdir)
+add_gadget_ep0_endpoint(gadget_ctx_t *ctx, epdir_t epdir)
 {
    int err;
    gadget_endpoint_t *ep;
@@ -88,11 +132,13 @@ add_gadget_ep0_endpoint(epdir_t epdir)
    if (err < 0) {
       goto fail2;
    }
+   init_in_ack(ep);
 
-   ep->usb_ep = gadget_state.gadget->ep0;
+   ep->usb_ep = ctx->gadget->ep0;
    ep->usb_ep->driver_data = ep;
+   ep->ctx = ctx;
 
-   list_add(&ep->list,&gadget_state.eplist);
+   ep_list_add((ep_t *)ep,&ctx->eplist);
 
    log(INFO,"Add gadget endpoint epid:[%s] ep:[%s]",dump_endpoint_id(&ep->epid),ep->epid,dump_usb_ep(ep->usb_ep));
 
@@ -120,7 +166,7 @@ ep_match_name(const char *name, const char *gname)
 
 /* Similar to what is done with usb_ep_autoconfig, but do not change address */
 static struct usb_ep *
-usb_ep_config(struct usb_endpoint_descriptor *desc)
+usb_ep_config(gadget_ctx_t *ctx, struct usb_endpoint_descriptor *desc)
 {
    struct usb_ep *ep = NULL;
 
@@ -133,7 +179,7 @@ usb_ep_config(struct usb_endpoint_descriptor *desc)
 
    log(DBG, "autoconf: Looking for endpoint %s\n", myname);
 
-   list_for_each_entry (ep, &gadget_state.gadget->ep_list, ep_list) {
+   list_for_each_entry (ep, &ctx->gadget->ep_list, ep_list) {
       if (ep_match_name(myname,ep->name)) {
          log(DBG,"Find valid ep:[%s]",dump_usb_ep(ep));
          if (ep->maxpacket_limit < (0x7ff & usb_endpoint_maxp(desc))) {
@@ -152,13 +198,13 @@ usb_ep_config(struct usb_endpoint_descriptor *desc)
 
 
 gadget_endpoint_t*
-add_gadget_endpoint(struct usb_endpoint_descriptor *epdesc)
+add_gadget_endpoint(gadget_ctx_t *ctx, struct usb_endpoint_descriptor *epdesc)
 {
    int err;
    gadget_endpoint_t *ep;
    struct usb_ep *usb_ep;
 
-   usb_ep = usb_ep_config(epdesc);
+   usb_ep = usb_ep_config(ctx, epdesc);
    if(!usb_ep) {
       log(ERR,"Unable to autoconfig endpoint desc:[%s]",dump_usb_endpoint_descriptor(epdesc));
       return NULL;
@@ -173,15 +219,17 @@ add_gadget_endpoint(struct usb_endpoint_descriptor *epdesc)
    if (err < 0) {
       goto fail2;
    }
+   init_in_ack(ep);
 
    ep->usb_ep = usb_ep;
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,1,0)
    usb_ep->desc = ep->desc;
 #endif
-   usb_ep->driver_data = gadget_state.gadget;
+   usb_ep->driver_data = ctx->gadget;
+   ep->ctx = ctx;
 
-   list_add(&ep->list,&gadget_state.eplist);
+   ep_list_add((ep_t *)ep,&ctx->eplist);
 
    err = usb_ep_disable(usb_ep);
    if (err<0) {
@@ -203,7 +251,7 @@ add_gadget_endpoint(struct usb_endpoint_descriptor *epdesc)
    return ep;
 
  fail3:
-   list_del_init(&ep->list);
+   ep_list_del((ep_t *)ep);
    free_endpoint((ep_t *)ep);
  fail2:
    kfree(ep);
@@ -216,13 +264,13 @@ add_gadget_endpoint(struct usb_endpoint_descriptor *epdesc)
 
 
 void
-dump_active_gadget_endpoints(void)
+dump_active_gadget_endpoints(gadget_ctx_t *ctx)
 {
    ep_t *ep;
    int i = 0;
 
    log(SPEC,"Active gadget endpoints");
-   list_for_each_entry(ep,&gadget_state.eplist,list) {
+   list_for_each_entry(ep,&ctx->eplist,list) {
       log(SPEC,"%u : %s",i,dump_usb_endpoint_descriptor(ep->desc));
       i++;
    }
@@ -231,7 +279,6 @@ dump_active_gadget_endpoints(void)
 void
 free_gadget_endpoint(gadget_endpoint_t *ep)
 {
-   gadget_request_t *req, *tmp;
    int err;
 
    log(DBG,"Free gadget endpoint [%s]",dump_endpoint_id(&ep->epid));
@@ -241,47 +288,44 @@ free_gadget_endpoint(gadget_endpoint_t *ep)
 #endif
 
    // Remove from list
-   list_del_init(&ep->list);
-
-   // Safe has to be used, because usb_ep_dequeue will call completion handler
-   // That will delete request from list
-   list_for_each_entry_safe(req,tmp,&ep->reqlist,list) {
-      // Using dequeue will raise completion routine with a status to -ECONNRESET
-      // Then request will be freed in completion routine
-      err = usb_ep_dequeue(ep->usb_ep,req->req);
-      if (err<0) {
-         log(WRN,"Unable to dequeue request [%d] epid:[%s]",err,dump_endpoint_id(&ep->epid));
-      }
-   }
+   ep_list_del((ep_t *)ep);
 
+   // Requests are not walked: completion may free them from under us
+   // Disabling completes every queued one with -ESHUTDOWN before returning,
+   // they are freed in completion routine, the others by their work
    usb_ep_fifo_flush(ep->usb_ep);
-
    err = usb_ep_disable(ep->usb_ep);
    if (err<0) {
       log(WRN,"Unable to disable [%d] epid:[%s]",err,dump_endpoint_id(&ep->epid));
    }
 
+   cancel_delayed_work_sync(&ep->ack_work);
+   latest_cancel(ep);
+
    free_endpoint((ep_t *)ep);
    kfree(ep);
 }
 
 gadget_endpoint_t*
-find_gadget_endpoint(const epid_t *id)
+find_gadget_endpoint(gadget_ctx_t *ctx, const epid_t *id)
 {
-   return (gadget_endpoint_t *)find_endpoint(id, &gadget_state.eplist);
+   return (gadget_endpoint_t *)find_endpoint(id, &ctx->eplist);
 }
 
 int
-disable_active_interface(void)
+disable_active_interface(gadget_ctx_t *ctx)
 {
    int i;
 
    log(DBG,"Disable active interfaces");
-   for (i=0; i<gadget_state.identity.nb_int; i++) {
-      interface_desc_t *iface = &gadget_state.identity.interfaces[i];
+   for (i=0; i<ctx->identity.nb_int; i++) {
+      ctx->identity.interfaces[i].target = 0;
+   }
+   for (i=0; i<ctx->identity.nb_int; i++) {
+      interface_desc_t *iface = &ctx->identity.interfaces[i];
       if (iface->active) {
          int err;
-         err = disable_interface(iface);
+         err = disable_interface(ctx, iface);
          if (err<0) {
             log(ERR,"Unable to disable interface [%d]",err);
             return err;
@@ -293,31 +337,88 @@ disable_active_interface(void)
 }
 
 /*
-  Activate all num 0 interfaces, with all their endpoints
+  Is this endpoint used, with the same descriptor, by an interface that will be active
  */
-int
-enable_default_interface(void)
+static int
+endpoint_targeted(gadget_ctx_t *ctx, const struct usb_endpoint_descriptor *desc)
+{
+   int i, j;
+
+   for (i=0; i<ctx->identity.nb_int; i++) {
+      interface_desc_t *iface = &ctx->identity.interfaces[i];
+      if (!iface->target) {
+         continue;
+      }
+      for (j=0; j<iface->desc.bNumEndpoints; j++) {
+         if (!memcmp(&iface->endpoints[j], desc, sizeof *desc)) {
+            return 1;
+         }
+      }
+   }
+   return 0;
+}
+
+/*
+  Move from active to target interface set
+  Endpoints shared by both sets are kept, with their in-flight requests
+ */
+static int
+apply_target_interfaces(gadget_ctx_t *ctx)
 {
    int i;
+   int err;
 
-   log(DBG,"Enable default interfaces");
-   // Enable all interface with altsetting 0
-   for (i=0; i<gadget_state.identity.nb_int; i++) {
-      interface_desc_t *iface = &gadget_state.identity.interfaces[i];
-      if (iface->desc.bAlternateSetting == 0) {
-         int err;
-         err = enable_interface(iface);
+   for (i=0; i<ctx->identity.nb_int; i++) {
+      interface_desc_t *iface = &ctx->identity.interfaces[i];
+      if (iface->active && !iface->target) {
+         err = disable_interface(ctx, iface);
          if (err<0) {
-            log(ERR,"Unable to enable interface [%d]",err);
+            log(WRN,"Unable to disable interface [%d] (%u,%u)",err,iface->desc.bInterfaceNumber,iface->desc.bAlternateSetting);
             return err;
          }
       }
    }
+
+   for (i=0; i<ctx->identity.nb_int; i++) {
+      interface_desc_t *iface = &ctx->identity.interfaces[i];
+      if (!iface->active && iface->target) {
+         err = enable_interface(ctx, iface);
+         if (err<0) {
+            log(ERR,"Unable to enable interface [%d] (%u,%u)",err,iface->desc.bInterfaceNumber,iface->desc.bAlternateSetting);
+            return err;
+         }
+      }
+   }
+
+   return 0;
+}
+
+/*
+  Activate all num 0 interfaces, with all their endpoints
+ */
+int
+enable_default_interface(gadget_ctx_t *ctx)
+{
+   int i;
+   int err;
+   u64 start = bench_now();
+
+   log(DBG,"Enable default interfaces");
+   for (i=0; i<ctx->identity.nb_int; i++) {
+      interface_desc_t *iface = &ctx->identity.interfaces[i];
+      iface->target = (iface->desc.bAlternateSetting == 0);
+   }
+
+   err = apply_target_interfaces(ctx);
+   if (err<0) {
+      return err;
+   }
+   bench_add(BENCH_ENABLE_INTERFACE,start);
    return 0;
 }
 
 int
-disable_interface(interface_desc_t *interface)
+disable_interface(gadget_ctx_t *ctx, interface_desc_t *interface)
 {
    int ep;
 
@@ -330,7 +431,12 @@ disable_interface(interface_desc_t *interface)
                      EP_DIR_FROM_KERNEL(desc->bEndpointAddress & USB_ENDPOINT_DIR_MASK)};
       gadget_endpoint_t *ep;
 
-      ep = find_gadget_endpoint(&epid);
+      if (endpoint_targeted(ctx, desc)) {
+         log(DBG,"Keeping endpoint %s",dump_endpoint_id(&epid));
+         continue;
+      }
+
+      ep = find_gadget_endpoint(ctx, &epid);
       if (ep) {
          log(DBG,"Disabling endpoint %s",dump_endpoint_id(&epid));
          free_gadget_endpoint(ep);
@@ -340,7 +446,7 @@ disable_interface(interface_desc_t *interface)
 }
 
 int
-enable_interface(interface_desc_t *interface)
+enable_interface(gadget_ctx_t *ctx, interface_desc_t *interface)
 {
    int ep;
    int err;
@@ -351,9 +457,21 @@ enable_interface(interface_desc_t *interface)
 
    for (ep=0; ep<interface->desc.bNumEndpoints; ep++) {
       struct usb_endpoint_descriptor *epdesc = &interface->endpoints[ep];
+      epid_t epid = {epdesc->bEndpointAddress & USB_ENDPOINT_NUMBER_MASK,
+                     EP_TYPE_FROM_KERNEL(epdesc->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK),
+                     EP_DIR_FROM_KERNEL(epdesc->bEndpointAddress & USB_ENDPOINT_DIR_MASK)};
       gadget_endpoint_t *epnew;
 
-      epnew = add_gadget_endpoint(epdesc);
+      epnew = find_gadget_endpoint(ctx, &epid);
+      if (epnew) {
+         if (!memcmp(epnew->desc, epdesc, sizeof *epdesc)) {
+            log(DBG,"Endpoint already enabled %s",dump_endpoint_id(&epid));
+            continue;
+         }
+         free_gadget_endpoint(epnew);
+      }
+
+      epnew = add_gadget_endpoint(ctx, epdesc);
       if(!epnew) {
          log(ERR,"Unable to add endpoint %u type:%s dir:%s",
              epdesc->bEndpointAddress,
@@ -377,43 +495,30 @@ enable_interface(interface_desc_t *interface)
 }
 
 int
-set_interface(ushort ifnumber, ushort alternative)
+set_interface(gadget_ctx_t *ctx, ushort ifnumber, ushort alternative)
 {
    int i;
-   int ret;
-   interface_desc_t *active = NULL;
+   int found = 0;
 
    log(DBG,"Set interface %u %u", ifnumber, alternative);
 
-   for (i=0; i<gadget_state.identity.nb_int; i++) {
-      interface_desc_t *interface = &gadget_state.identity.interfaces[i];
+   for (i=0; i<ctx->identity.nb_int; i++) {
+      interface_desc_t *interface = &ctx->identity.interfaces[i];
 
       if (interface->desc.bInterfaceNumber == ifnumber) {
-         if (interface->desc.bAlternateSetting == alternative) {
-            active = interface;
-         } else {
-            ret = disable_interface(interface);
-            if (ret != 0) {
-               log(WRN,"Unable to disable interface [%d] (%u,%u)",ret,interface->desc.bInterfaceNumber,interface->desc.bAlternateSetting);
-               return ret;
-            }
-         }
-      }
-   }
-
-   if (active) {
-      ret = enable_interface(active);
-      if (ret != 0) {
-         log(ERR,"Problem during enable interface [%d] (%u,%u)",ret,ifnumber,alternative);
-         return ret;
+         interface->target = (interface->desc.bAlternateSetting == alternative);
+         found |= interface->target;
       } else {
-         return 0;
+         interface->target = interface->active;
       }
    }
 
-   log(ERR,"Unable to set interface (%hu,%hu) : not found",ifnumber, alternative);
+   if (!found) {
+      log(ERR,"Unable to set interface (%hu,%hu) : not found",ifnumber, alternative);
+      return -EINVAL;
+   }
 
-   return -EINVAL;
+   return apply_target_interfaces(ctx);
 }
 
 /*-------------------------------------------------------------------------
@@ -425,6 +530,7 @@ gadget_request_t*
 alloc_gadget_request(gadget_endpoint_t *ep, const size_t sz, int type)
 {
    gadget_request_t *req;
+   unsigned long flags;
 
    req = kmalloc(sizeof *req, GFP_KERNEL);
    if (!req) {
@@ -441,7 +547,9 @@ alloc_gadget_request(gadget_endpoint_t *ep, const size_t sz, int type)
       goto fail3;
    }
 
+   spin_lock_irqsave(&ep->reqlist_lock,flags);
    list_add(&req->list,&ep->reqlist);
+   spin_unlock_irqrestore(&ep->reqlist_lock,flags);
 
    msg_set_epid(req->msg, &ep->epid);
    req->req->buf = msg_get_data(req->msg);
@@ -460,8 +568,12 @@ alloc_gadget_request(gadget_endpoint_t *ep, const size_t sz, int type)
 static void
 free_gadget_request(gadget_request_t *req)
 {
+   unsigned long flags;
+
    log(DBG,"Free gadget request epid:[%s]",dump_endpoint_id(&req->ep->epid));
+   spin_lock_irqsave(&req->ep->reqlist_lock,flags);
    list_del(&req->list);
+   spin_unlock_irqrestore(&req->ep->reqlist_lock,flags);
    free_msg(req->msg);
    usb_ep_free_request(req->ep->usb_ep,req->req);
    kfree(req);
@@ -490,6 +602,38 @@ recv(struct work_struct *data)
    ep->ops->free_request(ep, dreq);
 }
 
+/*
+  Successful OUT transfer, in completion context
+*/
+static void
+recv_fast(gadget_endpoint_t *ep, gadget_request_t *dreq)
+{
+   struct usb_request *req = dreq->req;
+   int err;
+
+   msg_set_data_size(dreq->msg, req->actual);
+
+   err = ep->ops->send_userland(ep, dreq->msg);
+   if (err < 0) {
+      goto free;
+   }
+
+   // Host is NAKed until peer gives credits back
+   if (!ep_take_credit((ep_t *)ep)) {
+      goto free;
+   }
+
+   err = usb_ep_queue(ep->usb_ep, req, GFP_ATOMIC);
+   if (err < 0) {
+      log(ERR,"Unable to queue OUT request again [%d] epid:[%s]",err,dump_endpoint_id(&ep->epid));
+      goto free;
+   }
+   return;
+
+ free:
+   ep->ops->free_request(ep, dreq);
+}
+
 static void
 gadget_recv_usb(struct usb_ep *endpoint, struct usb_request *req)
 {
@@ -502,37 +646,46 @@ gadget_recv_usb(struct usb_ep *endpoint, struct usb_request *req)
    // So a race can occcur, and ep could be freed
    if(req->status < 0) {
       log(ERR,"USB problem during reception [%d] epid:[%s]",req->status,dump_endpoint_id(&ep->epid));
+      if (ep_latest_enabled((ep_t *)ep)) {
+         latest_cancel(ep);
+      }
       ep->ops->free_request(ep,dreq);
       return;
    }
 
+   // OUT data is forwarded at once, request is queued again for next one
+   if (IS_OUT(ep) && ep_fast_path((ep_t *)ep, EP_CTX(ep)->com, dreq->msg)) {
+      recv_fast(ep, dreq);
+      return;
+   }
+
    INIT_WORK(&dreq->work, &recv);
 
-   err = queue_work(dreq->ep->wq, &dreq->work);
+   err = ep_queue_work((ep_t *)dreq->ep, &dreq->work);
    if(err < 0) {
       log(WRN,"Unable to queue work");
    }
 }
 
 int
-gadget_recv_userland_usb(msg_t *msg)
+gadget_recv_userland_usb(gadget_ctx_t *ctx, msg_t *msg)
 {
    int err;
 
    log_msg(DBG,msg,"UDP -- RECV");
 
-   if(!gadget_state.registered) {
-
+   if(!ctx->registered || !ctx->connected) {
+      log(DBG,"Gadget not connected, dropping message");
    } else {
       gadget_endpoint_t *ep;
 
-      ep = find_gadget_endpoint(&msg->epid);
+      ep = find_gadget_endpoint(ctx, &msg->epid);
       if (!ep) {
          log(ERR,"Unable to find endpoint epid:[%s]",dump_endpoint_id(&msg->epid));
          return -EINVAL;
       }
 
-      err = ep->ops->recv_userland(ep, msg);
+      err = ep_recv_userland((ep_t *)ep, msg);
       if (err<0) {
          log(ERR,"Unable to recv userland [%d] epid:[%s]",err,dump_endpoint_id(&ep->epid));
          return err;
@@ -541,6 +694,21 @@ gadget_recv_userland_usb(msg_t *msg)
    return 0;
 }
 
+struct list_head*
+gadget_peer_endpoints(int idx)
+{
+   gadget_ctx_t *ctx;
+
+   if (idx >= gadget_state.nb_ctx) {
+      return NULL;
+   }
+   ctx = &gadget_state.ctx[idx];
+   if (!ctx->registered || !ctx->connected) {
+      return NULL;
+   }
+   return &ctx->eplist;
+}
+
 
 int
 check_descriptor_header(char *buffer, int size)
@@ -710,6 +878,7 @@ parse_init_pkt(identity_t *identity, msg_t *msg)
 
          memcpy(&identity->interfaces[i_interface].desc,d,sizeof *d);
          identity->interfaces[i_interface].active = 0;
+         identity->interfaces[i_interface].target = 0;
          i_interface++;
       }
    }
@@ -718,7 +887,8 @@ parse_init_pkt(identity_t *identity, msg_t *msg)
    return ret;
 }
 
-struct usb_gadget_driver ubq_gadget = {
+// Template of the driver of each instance
+static const struct usb_gadget_driver ubq_gadget = {
    .function  = "ubq_gadget",
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,3,0)
    .speed = USB_SPEED_HIGH,
@@ -741,35 +911,139 @@ struct usb_gadget_driver ubq_gadget = {
 };
 
 
+typedef struct ep0_call_t {
+   struct work_struct work;
+   gadget_ctx_t *ctx;
+   int (*fn)(gadget_ctx_t *, msg_t *);
+   msg_t *msg;
+   int ret;
+} ep0_call_t;
+
+static void
+ep0_call(struct work_struct *work)
+{
+   ep0_call_t *c = container_of(work, ep0_call_t, work);
+
+   c->ret = c->fn(c->ctx, c->msg);
+}
+
+/*
+ * Run fn on the ep0 workqueue and wait for it, so that endpoints and
+ * identity never change under handle_setup or handle_disconnect
+ * Without ep0, gadget is not bound and nothing runs there
+ */
+static int
+ep0_run(gadget_ctx_t *ctx, int (*fn)(gadget_ctx_t *, msg_t *), msg_t *msg)
+{
+   ep0_call_t c = { .ctx = ctx, .fn = fn, .msg = msg, .ret = 0 };
+
+   if (!ctx->ep0) {
+      return fn(ctx, msg);
+   }
+
+   INIT_WORK_ONSTACK(&c.work, ep0_call);
+   ep_queue_work((ep_t *)ctx->ep0, &c.work);
+   flush_work(&c.work);
+   destroy_work_on_stack(&c.work);
+
+   return c.ret;
+}
+
+static int
+set_identity(gadget_ctx_t *ctx, msg_t *msg)
+{
+   int ret;
+   u64 start;
+
+   start = bench_now();
+   ret = parse_init_pkt(&ctx->identity,msg);
+   if (ret<0) {
+      log(WRN,"Unable to parser init pkt [%d]",ret);
+      return ret;
+   }
+   bench_add(BENCH_PARSE_INIT_PKT,start);
+
+   desc_cache_put(ctx->cache);
+   ctx->cache = desc_cache_get(&ctx->identity);
+   return 0;
+}
+
+// On ep0 workqueue
+static int
+swap_identity(gadget_ctx_t *ctx, msg_t *msg)
+{
+   int ret;
+   u64 start;
+
+   ubq_soft_disconnect(ctx);
+
+   ret = set_identity(ctx, msg);
+   if (ret<0) {
+      return ret;
+   }
+
+   start = bench_now();
+   ret = ubq_connect(ctx);
+   if (ret<0) {
+      log(ERR,"Unable to connect gadget [%d]",ret);
+      return ret;
+   }
+   bench_add(BENCH_REGISTER,start);
+   return 0;
+}
+
+// On ep0 workqueue
+static int
+forget_identity(gadget_ctx_t *ctx, msg_t *msg)
+{
+   if (ctx->registered) {
+      ubq_soft_disconnect(ctx);
+   }
+   desc_cache_put(ctx->cache);
+   ctx->cache = NULL;
+   return 0;
+}
+
+// On ep0 workqueue
+static int
+reenumerate(gadget_ctx_t *ctx, msg_t *msg)
+{
+   ubq_soft_disconnect(ctx);
+   return ubq_connect(ctx);
+}
+
 /*
  * Called when a new device packet is received
  */
 int
-callback_new_device(msg_t *msg)
+callback_new_device(gadget_ctx_t *ctx, msg_t *msg)
 {
    int ret;
-   identity_t *ident = &gadget_state.identity;
+   u64 start;
 
+   bench_transport_stop();
    log_msg(INFO,msg,"New device detected");
 
-   if (gadget_state.registered) {
-      log(WRN,"Device was already registered, force deregister");
-      ubq_unregister();
-      clean_endpoints();
+   // Gadget driver stays bound, only pulse the pull-up while swapping identity
+   if (ctx->registered) {
+      log(INFO,"Device was already registered, swap identity");
+      return ep0_run(ctx, swap_identity, msg);
    }
 
-   ret = parse_init_pkt(ident,msg);
+   ret = set_identity(ctx, msg);
    if (ret<0) {
-      log(WRN,"Unable to parser init pkt [%d]",ret);
       return ret;
    }
 
-   ret = ubq_register();
+   start = bench_now();
+   ret = ubq_register(ctx);
    if (ret<0) {
       log(ERR,"Unable to register driver [%d]",ret);
       return ret;
    }
-   gadget_state.registered = 1;
+   ctx->registered = 1;
+   ctx->connected = 1;
+   bench_add(BENCH_REGISTER,start);
 
    return 0;
 }
@@ -778,28 +1052,61 @@ callback_new_device(msg_t *msg)
  * Called when a reset is received
  */
 int
-callback_reset(msg_t *msg)
+callback_reset(gadget_ctx_t *ctx, msg_t *msg)
 {
    log(INFO,"DEVICE DISCONNECT !!");
-   gadget_state.registered = 0;
-   ubq_unregister();
-   clean_endpoints();
+   return ep0_run(ctx, forget_identity, msg);
+}
+
+/*
+  Peer has consumed OUT data, resubmit if endpoint was waiting for it
+*/
+static int
+callback_credit(gadget_ctx_t *ctx, msg_t *msg)
+{
+   credit_t *c = (credit_t *)msg->management_data;
+   gadget_endpoint_t *ep;
+   int err;
+
+   if (!ctx->registered || !ctx->connected) {
+      return 0;
+   }
 
+   ep = find_gadget_endpoint(ctx, &c->epid);
+   if (!ep) {
+      log(DBG,"Credits for unknown endpoint epid:[%s]",dump_endpoint_id(&c->epid));
+      return 0;
+   }
+
+   if (ep_grant_credits((ep_t *)ep, le32_to_cpu(c->credits)) && IS_OUT(ep)) {
+      log(DBG,"Credits back, resubmitting OUT endpoint [%s]",dump_endpoint_id(&ep->epid));
+      err = ep->ops->send_usb(ep,NULL);
+      if (err<0) {
+         log(ERR,"Unable to ask for OUT data [%d] epid:[%s]",err,dump_endpoint_id(&ep->epid));
+         return err;
+      }
+   }
    return 0;
 }
 
 int
-gadget_recv_userland_management(msg_t *msg)
+gadget_recv_userland_management(gadget_ctx_t *ctx, msg_t *msg)
 {
    int err;
-   if (IS_RESET_MNG_MSG(msg)) {
-      err = callback_reset(msg);
+   if (IS_CREDIT_MNG_MSG(msg)) {
+      err = callback_credit(ctx, msg);
+      if (err<0) {
+         log(ERR,"Unable to handle credits [%d]",err);
+         return err;
+      }
+   } else if (IS_RESET_MNG_MSG(msg)) {
+      err = callback_reset(ctx, msg);
       if (err<0) {
          log(ERR,"Unable to reset [%d]",err);
          return err;
       }
    } else if (IS_NEW_DEVICE_MNG_MSG(msg)) {
-      err = callback_new_device(msg);
+      err = callback_new_device(ctx, msg);
       if (err<0) {
          log(ERR,"Unable to callback new device [%d]",err);
          return err;
@@ -812,18 +1119,19 @@ gadget_recv_userland_management(msg_t *msg)
 }
 
 int
-gadget_recv_userland(msg_t *msg)
+gadget_recv_userland(com_t *com, msg_t *msg)
 {
+   gadget_ctx_t *ctx = (gadget_ctx_t *)com->priv;
    int err;
 
    if (IS_USB_MSG(msg)) {
-      err = gadget_recv_userland_usb(msg);
+      err = gadget_recv_userland_usb(ctx, msg);
       if (err<0) {
          log(ERR,"Unable to recv userland usb [%d]",err);
          return err;
       }
    } else if (IS_MANAGEMENT_MSG(msg)) {
-      err = gadget_recv_userland_management(msg);
+      err = gadget_recv_userland_management(ctx, msg);
       if (err<0) {
          log(ERR,"Unable to recv userland management [%d]",err);
          return err;
@@ -892,6 +1200,152 @@ ep_gadget_recv_usb_ctrl(gadget_endpoint_t *ep, gadget_request_t *req)
    return 0;
 }
 
+/*
+  Tell userland how many IN requests host consumed since last ACK
+*/
+static int
+flush_in_ack(gadget_endpoint_t *ep)
+{
+   ack_window_t a;
+   unsigned long flags;
+   msg_t *m;
+   int err;
+
+   spin_lock_irqsave(&ep->ack_lock,flags);
+   a.count = cpu_to_le32(ep->ack_count);
+   a.bytes = cpu_to_le32(ep->ack_bytes);
+   ep->ack_count = 0;
+   ep->ack_bytes = 0;
+   spin_unlock_irqrestore(&ep->ack_lock,flags);
+
+   if (!a.count) {
+      return 0;
+   }
+
+   m = alloc_msg_ack(&ep->epid, 0, (char *)&a, sizeof a);
+   if (!m) {
+      log(ERR,"Unable to allocate memory");
+      return -ENOMEM;
+   }
+   err = ep->ops->send_userland(ep,m);
+   free_msg(m);
+   if (err < 0) {
+      log(ERR,"Unable to send on userland [%d] epid:[%s]",err,dump_endpoint_id(&ep->epid));
+   }
+   return err;
+}
+
+static void
+ack_timeout(struct work_struct *work)
+{
+   gadget_endpoint_t *ep = container_of(to_delayed_work(work), gadget_endpoint_t, ack_work);
+
+   flush_in_ack(ep);
+}
+
+/*
+  ACK is sent once the window is full, or when the oldest request waited too long
+*/
+static int
+ack_in_consumed(gadget_endpoint_t *ep, unsigned int bytes)
+{
+   unsigned long flags;
+   int full;
+
+   spin_lock_irqsave(&ep->ack_lock,flags);
+   ep->ack_count++;
+   ep->ack_bytes += bytes;
+   full = ep->ack_count >= ack_window_size();
+   spin_unlock_irqrestore(&ep->ack_lock,flags);
+
+   if (full) {
+      cancel_delayed_work(&ep->ack_work);
+      return flush_in_ack(ep);
+   }
+   queue_delayed_work(ep->wq, &ep->ack_work, ack_delay());
+   return 0;
+}
+
+/*
+  Queue report to host, unless one is already in flight
+  Then it waits in place of the previous waiting one, which counts as consumed
+*/
+static int
+latest_send_usb(gadget_endpoint_t *ep, msg_t *msg)
+{
+   unsigned long flags;
+   msg_t *copy = NULL;
+   msg_t *old = NULL;
+   int err;
+
+ retry:
+   spin_lock_irqsave(&ep->ack_lock,flags);
+   if (!ep->in_flight) {
+      ep->in_flight = 1;
+      spin_unlock_irqrestore(&ep->ack_lock,flags);
+      free_msg(copy);
+      err = ep->ops->send_usb(ep, msg);
+      if (err < 0) {
+         latest_cancel(ep);
+      }
+      return err;
+   }
+   if (!copy) {
+      // Report has to wait, msg belongs to caller
+      spin_unlock_irqrestore(&ep->ack_lock,flags);
+      copy = dup_msg(msg);
+      if (!copy) {
+         log(ERR,"Unable to allocate memory");
+         return -ENOMEM;
+      }
+      goto retry;
+   }
+   old = ep->latest;
+   ep->latest = copy;
+   if (old) {
+      atomic64_inc(&ep->superseded);
+   }
+   spin_unlock_irqrestore(&ep->ack_lock,flags);
+
+   if (old) {
+      log(DBG,"Report superseded epid:[%s]",dump_endpoint_id(&ep->epid));
+      bench_count(BENCH_GADGET_INT_SUPERSEDED);
+      free_msg(old);
+      // Driver resubmits on ACK
+      return ack_in_consumed(ep, 0);
+   }
+   return 0;
+}
+
+/*
+  In flight report is done, send the waiting one if any
+*/
+static int
+latest_next(gadget_endpoint_t *ep)
+{
+   unsigned long flags;
+   msg_t *next;
+   int err;
+
+   spin_lock_irqsave(&ep->ack_lock,flags);
+   next = ep->latest;
+   ep->latest = NULL;
+   if (!next) {
+      ep->in_flight = 0;
+   }
+   spin_unlock_irqrestore(&ep->ack_lock,flags);
+
+   if (!next) {
+      return 0;
+   }
+   err = ep->ops->send_usb(ep, next);
+   free_msg(next);
+   if (err < 0) {
+      latest_cancel(ep);
+   }
+   return err;
+}
+
 int
 ep_gadget_recv_usb(gadget_endpoint_t *ep, gadget_request_t *req)
 {
@@ -907,16 +1361,36 @@ ep_gadget_recv_usb(gadget_endpoint_t *ep, gadget_request_t *req)
          return err;
       }
 
+      // Host is NAKed until peer gives credits back
+      if (!ep_take_credit((ep_t *)ep)) {
+         log(DBG,"No more credits, holding OUT endpoint [%s]",dump_endpoint_id(&ep->epid));
+         return 0;
+      }
+
       log(DBG,"Resubmitting OUT endpoint [%s]",dump_endpoint_id(&ep->epid));
 
-      // TODO: Wait for ACK from userland before resubmit
       err = ep->ops->send_usb(ep,NULL);  // Need to receive other OUT message, so resubmit
       if (err<0) {
          log(ERR,"Unable to ask for OUT data [%d] epid:[%s]",err,dump_endpoint_id(&ep->epid));
          return err;
       }
+   } else if (ep_latest_enabled((ep_t *)ep) && req->req->status == 0) {
+      log_msg(DBG,req->msg,"USB ++ SENT %s %s", dump_usb_request(req->req), dump_endpoint_id(&ep->epid));
+      err = ack_in_consumed(ep, req->req->actual);
+      if (err < 0) {
+         return err;
+      }
+      return latest_next(ep);
+   } else if (ack_window_size() > 1 && req->req->status == 0) {
+      log_msg(DBG,req->msg,"USB ++ SENT %s %s", dump_usb_request(req->req), dump_endpoint_id(&ep->epid));
+      return ack_in_consumed(ep, req->req->actual);
    } else { // IN message consumed by host, send ACK to user land
-      msg_t *m = alloc_msg_ack(&ep->epid, req->req->status, NULL, 0);
+      msg_t *m;
+
+      // Keep ACKs in order, an error one must not pass pending ones
+      flush_in_ack(ep);
+
+      m = alloc_msg_ack(&ep->epid, req->req->status, NULL, 0);
       if(!m) {
          log(ERR,"Unable to allocate memory");
          return -ENOMEM;
@@ -940,7 +1414,12 @@ ep_gadget_send_userland(gadget_endpoint_t *ep, msg_t *msg) {
    int err;
    log_msg(DBG,msg,"UDP -- SEND");
 
-   err = send_userland(gadget_state.com, msg);
+   // Driver forwards it itself if userland is late, request msg may carry an old tag
+   msg->tag = 0;
+   if (ep_deadline_enabled((ep_t *)ep, EP_CTX(ep)->com, msg)) {
+      ep_verdict_expect(driver_peer_endpoints(EP_CTX(ep)->idx), msg);
+   }
+   err = send_userland(EP_CTX(ep)->com, msg);
    if (err<0) {
       log(ERR,"Unable to send on userland [%d] epid:[%s]",err,dump_endpoint_id(&ep->epid));
       return err;
@@ -948,12 +1427,215 @@ ep_gadget_send_userland(gadget_endpoint_t *ep, msg_t *msg) {
    return 0;
 }
 
+/*
+ * Queue a CTRL IN response on ep0
+ * msg->data = [CTRL REQUEST | RESPONSE]
+ */
+static int
+answer_ctrl_in(gadget_endpoint_t *ep, msg_t *msg)
+{
+   int err;
+   struct usb_ctrlrequest *ctrl = (struct usb_ctrlrequest *)msg_get_data(msg);
+
+   // Need to find endpoint headers, to create them
+   // FIXME: 9 ?? Why 9 We need to get a complete response
+   // FIXME: Overlapp on ep->ctrl ???
+   if(IS_GET_DESC_CONFIGURATION(ctrl) && le16_to_cpu(ctrl->wLength) > 9) {
+      err = enable_default_interface(EP_CTX(ep));
+      if (err<0) {
+         log(ERR,"Unable to enable default interfaces [%d]",err);
+         return err;
+      }
+   }
+
+   err = ep->ops->send_usb(ep, msg);
+   if(err < 0) {
+      log(ERR,"Unable to send usb [%d] epid:[%s]",err,dump_endpoint_id(&ep->epid));
+      return err;
+   }
+   return 0;
+}
+
+static void
+flush_ctrl_pending(gadget_ctx_t *ctx)
+{
+   ctrl_pending_t *p, *tmp;
+   unsigned long flags;
+   LIST_HEAD(pending);
+
+   spin_lock_irqsave(&ctx->ctrl_lock,flags);
+   list_splice_init(&ctx->ctrl_pending,&pending);
+   spin_unlock_irqrestore(&ctx->ctrl_lock,flags);
+
+   list_for_each_entry_safe(p, tmp, &pending, list) {
+      list_del(&p->list);
+      kfree(p);
+   }
+}
+
+/*
+ * Try to answer a GET_DESCRIPTOR from cache, and remember the request
+ * so that the live response coming back from userland can be matched
+ */
+static ctrl_pending_t*
+ctrl_in_forwarded(gadget_endpoint_t *ep, const struct usb_ctrlrequest *ctrl)
+{
+   gadget_ctx_t *ctx = EP_CTX(ep);
+   ctrl_pending_t *p;
+   unsigned long flags;
+   msg_t *msg;
+   size_t len;
+
+   p = kmalloc(sizeof *p, GFP_KERNEL);
+   if (!p) {
+      log(ERR,"Unable to allocate memory");
+      return NULL;
+   }
+   memcpy(&p->ctrl, ctrl, sizeof *ctrl);
+   p->served = 0;
+
+   if (IS_GET_DESCRIPTOR(ctrl) && (ctrl->bRequestType & USB_RECIP_MASK) == USB_RECIP_DEVICE) {
+      msg = alloc_msg(sizeof *ctrl + le16_to_cpu(ctrl->wLength), DATA);
+      if (msg) {
+         msg_set_id(msg, 0, CTRL, IN);
+         msgcpy(msg, (void *)ctrl, sizeof *ctrl);
+         if (desc_cache_lookup(ctx->cache, ctrl, msg_get_data(msg) + sizeof *ctrl, &len)) {
+            msg_set_data_size(msg, sizeof *ctrl + len);
+            log(DBG,"Answer from cache %s",dump_usb_ctrlrequest(ctrl));
+            p->served = !answer_ctrl_in(ep, msg);
+         }
+         free_msg(msg);
+      }
+   }
+
+   spin_lock_irqsave(&ctx->ctrl_lock,flags);
+   list_add_tail(&p->list,&ctx->ctrl_pending);
+   spin_unlock_irqrestore(&ctx->ctrl_lock,flags);
+
+   return p;
+}
+
+/*
+ * Request could not be forwarded, no response will come for it
+ */
+static void
+ctrl_in_cancel(gadget_ctx_t *ctx, ctrl_pending_t *p)
+{
+   unsigned long flags;
+
+   spin_lock_irqsave(&ctx->ctrl_lock,flags);
+   list_del(&p->list);
+   spin_unlock_irqrestore(&ctx->ctrl_lock,flags);
+   kfree(p);
+}
+
+/*
+ * Take the pending request msg answers
+ * DATA echoes the setup packet, requests queued before it got no response
+ * and are dropped. ACK carries none, it stands for the oldest one
+ */
+static ctrl_pending_t*
+ctrl_in_take(gadget_ctx_t *ctx, const msg_t *msg)
+{
+   ctrl_pending_t *p, *tmp, *found = NULL;
+   unsigned long flags;
+   LIST_HEAD(stale);
+
+   spin_lock_irqsave(&ctx->ctrl_lock,flags);
+   if (IS_USB_ACK(msg) || msg_get_data_size(msg) < sizeof p->ctrl) {
+      found = list_first_entry_or_null(&ctx->ctrl_pending, ctrl_pending_t, list);
+   } else {
+      list_for_each_entry(p, &ctx->ctrl_pending, list) {
+         if (!memcmp(&p->ctrl, msg_get_data(msg), sizeof p->ctrl)) {
+            found = p;
+            break;
+         }
+      }
+      if (found) {
+         list_for_each_entry_safe(p, tmp, &ctx->ctrl_pending, list) {
+            if (p == found) {
+               break;
+            }
+            list_move_tail(&p->list, &stale);
+         }
+      }
+   }
+   if (found) {
+      list_del(&found->list);
+   }
+   spin_unlock_irqrestore(&ctx->ctrl_lock,flags);
+
+   list_for_each_entry_safe(p, tmp, &stale, list) {
+      log(DBG,"No response for %s, dropped",dump_usb_ctrlrequest(&p->ctrl));
+      list_del(&p->list);
+      kfree(p);
+   }
+   return found;
+}
+
+/*
+ * Record live GET_DESCRIPTOR response
+ * Return 1 if a response already served from cache was wrong
+ */
+static int
+ctrl_in_response(gadget_ctx_t *ctx, msg_t *msg, ctrl_pending_t *p)
+{
+   struct usb_ctrlrequest *ctrl = &p->ctrl;
+   char *buf;
+   size_t len;
+   int changed;
+
+   if (IS_USB_ACK(msg) || msg_get_data_size(msg) < sizeof *ctrl) {
+      if (p->served) {
+         desc_cache_forget(ctx->cache, ctrl);
+      }
+      return p->served;
+   }
+
+   if (!IS_GET_DESCRIPTOR(ctrl) || (ctrl->bRequestType & USB_RECIP_MASK) != USB_RECIP_DEVICE) {
+      return 0;
+   }
+
+   buf = msg_get_data(msg) + sizeof *ctrl;
+   len = msg_get_data_size(msg) - sizeof *ctrl;
+
+   if (ctx->identity.device.iSerialNumber &&
+       le16_to_cpu(ctrl->wValue) == ((USB_DT_STRING << 8) | ctx->identity.device.iSerialNumber)) {
+      ctx->cache = desc_cache_set_serial(ctx->cache, buf, len);
+   }
+
+   changed = desc_cache_store(ctx->cache, ctrl, buf, len);
+   return changed && p->served;
+}
+
 int
 ep_gadget_recv_userland_ctrl(gadget_endpoint_t *ep, msg_t *msg)
 {
+   gadget_ctx_t *ctx = EP_CTX(ep);
    int err;
    struct usb_ctrlrequest *ctrl = (struct usb_ctrlrequest *)msg_get_data(msg);
 
+   if (IS_IN(ep) && desc_cache_enabled()) {
+      ctrl_pending_t *p;
+      int served = 0;
+
+      p = ctrl_in_take(ctx, msg);
+      if (p) {
+         served = p->served;
+         if (ctrl_in_response(ctx, msg, p)) {
+            // Host has been given stale descriptors, enumerate again
+            log(WRN,"Cached descriptor mismatch %s, reconnecting",dump_usb_ctrlrequest(&p->ctrl));
+            kfree(p);
+            return ep0_run(ctx, reenumerate, NULL);
+         }
+         kfree(p);
+      }
+      if (served) {
+         log(DBG,"Live response already served from cache");
+         return 0;
+      }
+   }
+
    if (IS_USB_ACK(msg)) {
       log(WRN,"RECV ACK [%d] halting epid:[%s]",msg->status,dump_endpoint_id(&ep->epid));
       if (msg->status == -EPIPE) {
@@ -963,28 +1645,11 @@ ep_gadget_recv_userland_ctrl(gadget_endpoint_t *ep, msg_t *msg)
    }
 
    log_msg(DBG,msg,"RECV CTRL from USERLAND epid:[%s] ctrl:[%s]",dump_endpoint_id(&ep->epid),dump_usb_ctrlrequest(ctrl));
+   bench_ep0_stop();
 
    if (IS_IN(ep)) {
-      // Need to find endpoint headers, to create them
-      // FIXME: 9 ?? Why 9 We need to get a complete response
-      // FIXME: Overlapp on ep->ctrl ???
-      if(IS_GET_DESC_CONFIGURATION(ctrl) && le16_to_cpu(ctrl->wLength) > 9) {
-         err = disable_active_interface();
-         if (err<0) {
-            log(ERR,"Unable to disable active interfaces [%d]",err);
-            return err;
-         }
-
-         err = enable_default_interface();
-         if (err<0) {
-            log(ERR,"Unable to enable default interfaces [%d]",err);
-            return err;
-         }
-      }
-
-      err = ep->ops->send_usb(ep, msg);
+      err = answer_ctrl_in(ep, msg);
       if(err < 0) {
-         log(ERR,"Unable to send usb [%d] epid:[%s]",err,dump_endpoint_id(&ep->epid));
          return err;
       }
    } else {  // OUT
@@ -1002,9 +1667,33 @@ ep_gadget_recv_userland_ctrl(gadget_endpoint_t *ep, msg_t *msg)
 
 int
 ep_gadget_recv_userland(gadget_endpoint_t *ep, msg_t *msg) {
+   msg_t *full;
    int err;
 
-   err = ep->ops->send_usb(ep, msg);
+   err = ep_delta_decode((ep_t *)ep, msg, &full);
+   if (err<0) {
+      msg_t *m;
+
+      // Driver sends next payload as is, and resubmits
+      log(WRN,"Unable to rebuild DELTA payload epid:[%s]",dump_endpoint_id(&ep->epid));
+      m = alloc_msg_ack(&ep->epid, err, NULL, 0);
+      if (!m) {
+         log(ERR,"Unable to allocate memory");
+         return -ENOMEM;
+      }
+      err = ep->ops->send_userland(ep,m);
+      free_msg(m);
+      return err < 0 ? err : 0;
+   }
+
+   if (ep_latest_enabled((ep_t *)ep)) {
+      err = latest_send_usb(ep, full ? full : msg);
+   } else {
+      err = ep->ops->send_usb(ep, full ? full : msg);
+   }
+   if (full) {
+      free_msg(full);
+   }
    if (err<0) {
       log(ERR,"Unable to send usb [%d] epid:[%s]",err,dump_endpoint_id(&ep->epid));
       return err;
@@ -1112,22 +1801,31 @@ int
 ubq_bind(struct usb_gadget *gadget, struct usb_gadget_driver *driver)
 #endif
 {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,7,0)
+   gadget_ctx_t *ctx = &gadget_state.ctx[0];
+#else
+   gadget_ctx_t *ctx = container_of(driver, gadget_ctx_t, driver);
+#endif
    int err;
+   u64 start = bench_now();
 
-   gadget_state.gadget = gadget;
+   ctx->gadget = gadget;
+   set_gadget_data(gadget, ctx);
 
    usb_ep_autoconfig_reset(gadget);
 
-   if (!add_gadget_ep0_endpoint(IN)) {
+   ctx->ep0 = add_gadget_ep0_endpoint(ctx, IN);
+   if (!ctx->ep0) {
       log(ERR,"bind: failure");
-      return err;
+      return -ENOMEM;
    }
 
-   if (!add_gadget_ep0_endpoint(OUT)) {
+   if (!add_gadget_ep0_endpoint(ctx, OUT)) {
       log(ERR,"bind: failure");
-      return err;
+      return -ENOMEM;
    }
 
+   bench_add(BENCH_BIND,start);
    return 0;
 }
 
@@ -1135,6 +1833,7 @@ static void
 ubq_unbind(struct usb_gadget *gadget)
 {
    gadget->ep0->driver_data = NULL;
+   set_gadget_data(gadget, NULL);
 }
 
 
@@ -1142,15 +1841,17 @@ static void
 handle_setup(struct work_struct *data)
 {
    setup_request_t *setup = (setup_request_t *)data;
+   gadget_ctx_t *ctx = setup->ctx;
    struct usb_ctrlrequest *ctrl = setup->ctrl;
    gadget_endpoint_t *ep;
    int err;
    epid_t epid = {0,CTRL,EP_DIR_FROM_KERNEL(ctrl->bRequestType & USB_ENDPOINT_DIR_MASK)};
    msg_t *msg;
+   ctrl_pending_t *p = NULL;
 
    trace;
 
-   ep = find_gadget_endpoint(&epid);
+   ep = find_gadget_endpoint(ctx, &epid);
    if(!ep) {
       log(ERR,"Unable to find endpoint epid:[%s]",dump_endpoint_id(&epid));
       goto end;
@@ -1179,9 +1880,10 @@ handle_setup(struct work_struct *data)
          switch (ctrl->bRequest) {
          case USB_REQ_SET_CONFIGURATION:
             log(DBG,"RECEIVE SET CONFIGURATION");
+            bench_configured();
             break;
          case USB_REQ_SET_INTERFACE:
-            err = set_interface(le16_to_cpu(ctrl->wIndex),le16_to_cpu(ctrl->wValue));
+            err = set_interface(ctx, le16_to_cpu(ctrl->wIndex),le16_to_cpu(ctrl->wValue));
             if (err<0) {
                log(ERR,"Unable to set interface [%d]",err);
                goto end;
@@ -1189,9 +1891,15 @@ handle_setup(struct work_struct *data)
             break;
          }
       }
+      if (IS_IN(ep) && desc_cache_enabled()) {
+         p = ctrl_in_forwarded(ep, ctrl);
+      }
       err = ep->ops->send_userland(ep, msg);
       if(err < 0) {
          log(ERR,"Unable to send to userland [%d] epid:[%s]",err,dump_endpoint_id(&ep->epid));
+         if (p) {
+            ctrl_in_cancel(ctx, p);
+         }
          goto end;
       }
       if (IS_OUT(ep) && le16_to_cpu(ctrl->wLength) == 0) {
@@ -1215,6 +1923,7 @@ handle_setup(struct work_struct *data)
 static int
 ubq_setup(struct usb_gadget *gadget, const struct usb_ctrlrequest *ctrl)
 {
+   gadget_ctx_t *ctx = get_gadget_data(gadget);
    int err;
    setup_request_t *setup;
    gadget_endpoint_t *ep;
@@ -1222,9 +1931,14 @@ ubq_setup(struct usb_gadget *gadget, const struct usb_ctrlrequest *ctrl)
 
    trace;
 
+   bench_ep0_start();
    gadget->ep0->driver_data = gadget;
 
-   ep = find_gadget_endpoint(&epid);
+   if (!ctx) {
+      err = -EINVAL;
+      goto fail1;
+   }
+   ep = find_gadget_endpoint(ctx, &epid);
    if(!ep) {
       log(ERR,"Unable to find gadget endpoint epid:[%s]",dump_endpoint_id(&epid));
       err = -EINVAL;
@@ -1246,10 +1960,12 @@ ubq_setup(struct usb_gadget *gadget, const struct usb_ctrlrequest *ctrl)
    }
 
    memcpy(setup->ctrl,ctrl,sizeof *ctrl);
+   setup->ctx = ctx;
 
    INIT_WORK(&setup->work, &handle_setup);
 
-   err = queue_work(ep->wq, &setup->work);
+   // Both directions go through ep0 IN queue, ordered with endpoint changes
+   err = ep_queue_work((ep_t *)ctx->ep0, &setup->work);
    if(err < 0) {
       log(WRN,"Unable to queue work handle_setup");
       goto fail2;
@@ -1264,58 +1980,191 @@ ubq_setup(struct usb_gadget *gadget, const struct usb_ctrlrequest *ctrl)
 }
 
 
+/*
+  Function executed by ep0 workqueue, so serialized with handle_setup
+*/
+static void
+handle_disconnect(struct work_struct *data)
+{
+   gadget_ctx_t *ctx = container_of(data, gadget_ctx_t, disconnect_work);
+   int err;
+
+   log(DBG,"Host disconnect, disable active interfaces");
+   err = disable_active_interface(ctx);
+   if (err<0) {
+      log(ERR,"Unable to disable active interfaces [%d]",err);
+   }
+}
+
+/*
+  Called in interrupt context by the UDC on disconnect and bus reset
+  Endpoints cannot be freed here, so it is deferred
+*/
 static void
 ubq_disconnect(struct usb_gadget *gadget)
 {
+   gadget_ctx_t *ctx = get_gadget_data(gadget);
+
+   if (!ctx || !ctx->ep0) {
+      return;
+   }
+   ep_queue_work((ep_t *)ctx->ep0, &ctx->disconnect_work);
 }
 
 
 static void
-clean_endpoints(void)
+clean_endpoints(gadget_ctx_t *ctx)
 {
    ep_t *ep, *tmp;
    // Free endpoints
-   list_for_each_entry_safe(ep, tmp, &gadget_state.eplist, list) {
+   ctx->ep0 = NULL;
+   list_for_each_entry_safe(ep, tmp, &ctx->eplist, list) {
       free_gadget_endpoint((gadget_endpoint_t *)ep);
    }
 }
 
+/*
+  Free every endpoint but ep0, which belongs to the bound gadget
+*/
+static void
+clean_interface_endpoints(gadget_ctx_t *ctx)
+{
+   ep_t *ep, *tmp;
+   int i;
+
+   list_for_each_entry_safe(ep, tmp, &ctx->eplist, list) {
+      if (ep->epid.num != 0) {
+         free_gadget_endpoint((gadget_endpoint_t *)ep);
+      }
+   }
+   for (i=0; i<ctx->identity.nb_int; i++) {
+      ctx->identity.interfaces[i].active = 0;
+      ctx->identity.interfaces[i].target = 0;
+   }
+}
+
 int
-ubq_register(void)
+ubq_register(gadget_ctx_t *ctx)
 {
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,7,0)
-   return usb_gadget_probe_driver(&ubq_gadget,ubq_bind);
+   return usb_gadget_probe_driver(&ctx->driver,ubq_bind);
 #else
-   return usb_gadget_probe_driver(&ubq_gadget);
+   return usb_gadget_probe_driver(&ctx->driver);
 #endif
 }
 
 
 void
-ubq_unregister(void)
+ubq_unregister(gadget_ctx_t *ctx)
+{
+   usb_gadget_unregister_driver(&ctx->driver);
+}
+
+/*
+  Soft-disconnect from host, driver stays bound to the UDC
+*/
+void
+ubq_soft_disconnect(gadget_ctx_t *ctx)
 {
-   usb_gadget_unregister_driver(&ubq_gadget);
+   int err;
+
+   if (ctx->connected) {
+      err = usb_gadget_disconnect(ctx->gadget);
+      if (err<0) {
+         log(WRN,"Unable to soft-disconnect gadget [%d]",err);
+      }
+      ctx->connected = 0;
+   }
+   // disconnect_work queued meanwhile runs after, with nothing left to disable
+   flush_ctrl_pending(ctx);
+   clean_interface_endpoints(ctx);
+}
+
+int
+ubq_connect(gadget_ctx_t *ctx)
+{
+   int err;
+
+   err = usb_gadget_connect(ctx->gadget);
+   if (err<0) {
+      return err;
+   }
+   ctx->connected = 1;
+   return 0;
 }
 
 int
 ubq_gadget_init(void)
 {
-   struct udp_opt_t options;
+   int i;
 
    trace;
 
-   gadget_state.registered = 0;
-   INIT_LIST_HEAD(&gadget_state.eplist);
+   // Every instance needs its own channel, netlink included
+   BUILD_BUG_ON(GADGET_MAX_DEVICES > COM_MAX_INSTANCES);
 
-   options.port = SERVER_PORT;
-   options.connect = 0;
+   desc_cache_init();
 
-   gadget_state.com = com_init((void *)&options,gadget_recv_userland,"GADGET");
-   if (!gadget_state.com) {
-      return -ENOMEM;
+   gadget_state.nb_ctx = clamp(max(gadgets, nb_udc), 1, GADGET_MAX_DEVICES);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,5,0)
+   if (gadget_state.nb_ctx > 1) {
+      log(WRN,"UDC cannot be chosen before 4.5, only one gadget instance");
+      gadget_state.nb_ctx = 1;
+   }
+#endif
+
+   for (i=0; i<gadget_state.nb_ctx; i++) {
+      gadget_ctx_t *ctx = &gadget_state.ctx[i];
+      com_opt_t options;
+      char name[MAX_SIZE_ID];
+
+      ctx->idx = i;
+      ctx->registered = 0;
+      ctx->connected = 0;
+      INIT_LIST_HEAD(&ctx->eplist);
+      INIT_WORK(&ctx->disconnect_work, &handle_disconnect);
+      INIT_LIST_HEAD(&ctx->ctrl_pending);
+      spin_lock_init(&ctx->ctrl_lock);
+      ctx->cache = NULL;
+
+      // Driver names must differ once registered on the gadget bus
+      ctx->driver = ubq_gadget;
+      if (i == 0) {
+         snprintf(ctx->name, sizeof ctx->name, "ubq_gadget");
+      } else {
+         snprintf(ctx->name, sizeof ctx->name, "ubq_gadget%d", i);
+      }
+      ctx->driver.function = ctx->name;
+      ctx->driver.driver.name = ctx->name;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,5,0)
+      ctx->driver.udc_name = i < nb_udc ? udc[i] : NULL;
+#endif
+
+      options.channel = GADGET_CHANNEL;
+      options.port = SERVER_PORT + i*COM_INSTANCE_PORTS;
+      options.addr = 0;
+      options.connect = 0;
+      options.instance = i;
+
+      if (i == 0) {
+         snprintf(name, sizeof name, "GADGET");
+      } else {
+         snprintf(name, sizeof name, "GADGET%d", i);
+      }
+      ctx->com = com_init((void *)&options,gadget_recv_userland,name,ctx);
+      if (IS_ERR(ctx->com)) {
+         int err = PTR_ERR(ctx->com);
+
+         log(ERR,"Unable to initialise communication of gadget %d [%d]",i,err);
+         while (i--) {
+            com_close(gadget_state.ctx[i].com);
+         }
+         desc_cache_exit();
+         return err;
+      }
    }
 
-   log(INFO,"GADGET INIT OK");
+   log(INFO,"GADGET INIT OK (%d instances)",gadget_state.nb_ctx);
 
    return 0;
 }
@@ -1323,11 +2172,21 @@ ubq_gadget_init(void)
 void
 ubq_gadget_exit(void)
 {
-   if(gadget_state.registered) {
-      ubq_unregister();
+   int i;
+
+   for (i=0; i<gadget_state.nb_ctx; i++) {
+      gadget_ctx_t *ctx = &gadget_state.ctx[i];
+
+      if(ctx->registered) {
+         ubq_unregister(ctx);
+      }
+      flush_work(&ctx->disconnect_work);
+      clean_endpoints(ctx);
+      com_close(ctx->com);
+      flush_ctrl_pending(ctx);
+      desc_cache_put(ctx->cache);
    }
-   clean_endpoints();
-   com_close(gadget_state.com);
+   desc_cache_exit();
 
    log(INFO,"GADGET_EXIT OK");
 }
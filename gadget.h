@@ -2,11 +2,20 @@
 #define __UBQ_GADGET_H
 
 #define SERVER_PORT 64241
+#define GADGET_MAX_DEVICES 4
 
 // Carefull ep shall remain the first attribute
 typedef struct gadget_endpoint_t {
    ep_t;
    struct usb_ep *usb_ep;
+   // IN requests consumed by host, not acknowledged yet to userland
+   spinlock_t ack_lock;
+   u32 ack_count;
+   u32 ack_bytes;
+   struct delayed_work ack_work;
+   // Latest value policy, under ack_lock
+   int in_flight;
+   msg_t *latest; // Newest report waiting for in flight one
 } gadget_endpoint_t;
 
 typedef struct gadget_request_t {
@@ -17,18 +26,42 @@ typedef struct gadget_request_t {
    struct list_head list;
 } gadget_request_t;
 
+// ep0 IN request forwarded to userland, waiting for its response
+typedef struct ctrl_pending_t {
+   struct list_head list;
+   struct usb_ctrlrequest ctrl;
+   int served; // Already answered from descriptor cache
+} ctrl_pending_t;
+
+// One gadget on one UDC, with its own channel
+typedef struct gadget_ctx_t {
+   int idx;
+   struct usb_gadget_driver driver;
+   char name[16]; // Driver name, unique on the gadget bus
+   struct usb_gadget  *gadget;
+   com_t *com;
+   int registered;
+   int connected;
+   struct list_head eplist;
+   identity_t identity;
+   gadget_endpoint_t *ep0; // ep0 IN, its ordered workqueue runs setups and endpoint changes
+   struct work_struct disconnect_work;
+   desc_cache_entry_t *cache;
+   spinlock_t ctrl_lock;
+   struct list_head ctrl_pending;
+} gadget_ctx_t;
+
+#define EP_CTX(ep) ((gadget_ctx_t *)((ep_t *)(ep))->ctx)
+
 typedef struct setup_request_t {
    struct work_struct work;
    struct usb_ctrlrequest *ctrl;
+   gadget_ctx_t *ctx;
 } setup_request_t;
 
 static struct gadget_state {
-   struct usb_gadget  *gadget;
-   com_t *com;
-   struct usb_device_descriptor descriptor; // Current device descriptor
-   int registered;
-   struct list_head eplist;
-   identity_t identity;
+   int nb_ctx;
+   gadget_ctx_t ctx[GADGET_MAX_DEVICES];
 } gadget_state;
 
 
@@ -55,13 +88,14 @@ void ep_free_gadget_request(gadget_endpoint_t *ep, gadget_request_t *req);
 
 
 
-static void clean_endpoints(void);
+static void clean_endpoints(gadget_ctx_t *);
+static void clean_interface_endpoints(gadget_ctx_t *);
 
 // Interface management
-int disable_active_interface(void);
-int enable_default_interface(void);
-int disable_interface(interface_desc_t *);
-int enable_interface(interface_desc_t *);
+int disable_active_interface(gadget_ctx_t *);
+int enable_default_interface(gadget_ctx_t *);
+int disable_interface(gadget_ctx_t *, interface_desc_t *);
+int enable_interface(gadget_ctx_t *, interface_desc_t *);
 
 // Gadget specific
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,7,0)
@@ -75,8 +109,10 @@ static int ubq_setup(struct usb_gadget *,const struct usb_ctrlrequest *);
 
 // Module specific
 int gadget_init(void);
-int ubq_register(void);
-void ubq_unregister(void);
+int ubq_register(gadget_ctx_t *);
+void ubq_unregister(gadget_ctx_t *);
+int ubq_connect(gadget_ctx_t *);
+void ubq_soft_disconnect(gadget_ctx_t *);
 void gadget_exit(void);
 
 
@@ -2,6 +2,7 @@
 #include "msg.h"
 #include <linux/kernel.h>
 #include <linux/slab.h>
+#include <linux/stddef.h>
 
 static char debug_msg[256];
 
@@ -12,6 +13,8 @@ char *dump_msg(const msg_t *m)
       snprintf(debug_msg,256,"msg:NULL");
    } else if (IS_USB_DATA(m)) {
       snprintf(debug_msg,256,"msg:%p asize:%u data_size:%u %s",m,m->allocated_size,msg_get_data_size(m),dump_endpoint_id(&m->epid));
+   } else if (IS_USB_DELTA(m)) {
+      snprintf(debug_msg,256,"msg:%p asize:%u data_size:%u DELTA %s",m,m->allocated_size,msg_get_data_size(m),dump_endpoint_id(&m->epid));
    } else if (IS_USB_ACK(m)) {
       snprintf(debug_msg,256,"msg:%p asize:%u data_size:%u ACK status:%d %s",m,m->allocated_size,msg_get_data_size(m),m->status,dump_endpoint_id(&m->epid));
    } else {
@@ -23,7 +26,7 @@ char *dump_msg(const msg_t *m)
 size_t _msg_diff_size(int type)
 {
    size_t sz = sizeof(msg_type_t) + sizeof(size_t);
-   if (type == DATA) {
+   if (type == DATA || type == DELTA) {
       sz += sizeof(epid_t);
    } else if (type == ACK) {
       sz += sizeof(epid_t) + sizeof(int);
@@ -57,10 +60,11 @@ msg_t* alloc_msg(size_t size, int type)
 {
    msg_t *m;
 
-   m = kmalloc(size + _msg_diff_size(type) + sizeof(size_t), GFP_KERNEL);
+   m = kmalloc(size + _msg_diff_size(type) + MSG_HEAD_SIZE, GFP_KERNEL);
    if (!m) {
       return NULL;
    }
+   m->tag = 0;
    // In fact allocated size is greater than size (MSG_REAL_SIZE(size))
    // But we keep size, because this allocated size will be sent to host
    // It is the allocated size for message
@@ -98,6 +102,39 @@ msg_t* alloc_msg_management(size_t size)
    return alloc_msg(size,MANAGEMENT);
 }
 
+msg_t* alloc_msg_credit(const epid_t *epid, u32 credits)
+{
+   msg_t *m;
+   credit_t c;
+
+   m = alloc_msg(sizeof c,MANAGEMENT);
+   if (!m) {
+      return NULL;
+   }
+
+   m->management_type = CREDIT;
+   c.epid = *epid;
+   c.credits = cpu_to_le32(credits);
+   msgcpy(m,&c,sizeof c);
+   return m;
+}
+
+/*
+  Copy of a received message, allocated to its actual size
+*/
+msg_t* dup_msg(const msg_t *m)
+{
+   msg_t *d;
+
+   d = kmalloc(m->size + MSG_HEAD_SIZE, GFP_KERNEL);
+   if (!d) {
+      return NULL;
+   }
+   memcpy(d, m, m->size + MSG_HEAD_SIZE);
+   d->allocated_size = msg_get_data_size(m);
+   return d;
+}
+
 void free_msg(msg_t *m) {
    kfree(m);
 }
@@ -144,10 +181,18 @@ check_msg(msg_t *msg)
       if (msg->size < size) {
          return 0;
       }
-      if (msg->management_type != RESET && msg->management_type != RELOAD && msg->management_type != NEW_DEVICE) {
+      if (msg->management_type != RESET && msg->management_type != RELOAD && msg->management_type != NEW_DEVICE &&
+          msg->management_type != SET_VERSION && msg->management_type != CREDIT &&
+          msg->management_type != REL_ACK) {
+         return 0;
+      }
+      if (msg->management_type == CREDIT && msg->size < size + sizeof(credit_t)) {
          return 0;
       }
-   } else if (msg->type == DATA || msg->type == ACK) {
+      if (msg->management_type == REL_ACK && msg->size < size + sizeof(rel_ack_t)) {
+         return 0;
+      }
+   } else if (msg->type == DATA || msg->type == ACK || msg->type == DELTA) {
       size += sizeof(epid_t);
       if (msg->size < size) {
          return 0;
@@ -169,3 +214,161 @@ check_msg(msg_t *msg)
    }
    return 1;
 }
+
+
+/*
+ * Wire format v2
+ * Header is written in place right before payload, so nothing is copied
+ */
+#define MSG_OFFSET(field) (offsetof(msg_t, field) - offsetof(msg_t, size))
+
+size_t
+msg_frame_len(int version, const char *buf)
+{
+   if (version == WIRE_V1) {
+      return *(const size_t *)buf;
+   }
+   return sizeof(wire_hdr_t) + le32_to_cpu(((const wire_hdr_t *)buf)->len);
+}
+
+static char *
+msg_wire_payload(msg_t *msg)
+{
+   if (IS_MANAGEMENT_MSG(msg)) {
+      return (char *)msg->management_data;
+   } else if (IS_USB_ACK(msg)) {
+      return (char *)&msg->status;
+   }
+   return (char *)msg->data;
+}
+
+/*
+  Write v2 header before payload
+  Return frame length, overwritten bytes are kept in save
+*/
+size_t
+msg_wire_encode(msg_t *msg, u8 flags, u32 seq, wire_save_t *save)
+{
+   char *payload = msg_wire_payload(msg);
+   size_t len = msg->size - (payload - (char *)&msg->size);
+   __le32 tag = cpu_to_le32(msg->tag);
+   wire_hdr_t hdr;
+
+   // Tag goes between header and data, read before it is overwritten
+   save->hdr_len = sizeof hdr;
+   if (IS_USB_DATA(msg) && msg->tag) {
+      flags |= WIRE_F_TAG;
+      save->hdr_len += sizeof tag;
+      len += sizeof tag;
+   }
+
+   hdr.version = WIRE_V2;
+   hdr.flags = flags;
+   hdr.type = msg->type;
+   if (IS_MANAGEMENT_MSG(msg)) {
+      hdr.ep = msg->management_type;
+   } else {
+      hdr.ep = (msg->epid.num & WIRE_EP_NUM_MASK) |
+         ((msg->epid.type << WIRE_EP_TYPE_SHIFT) & WIRE_EP_TYPE_MASK) |
+         (msg->epid.dir == OUT ? WIRE_EP_DIR : 0);
+   }
+   hdr.len = cpu_to_le32(len);
+   hdr.seq = cpu_to_le32(seq);
+
+   save->ack = IS_USB_ACK(msg);
+   if (save->ack) {
+      save->status = msg->status;
+      msg->status = (__force int)cpu_to_le32(save->status);
+   }
+   save->frame = payload - save->hdr_len;
+   memcpy(save->hdr, save->frame, save->hdr_len);
+   memcpy(save->frame, &hdr, sizeof hdr);
+   if (flags & WIRE_F_TAG) {
+      memcpy(save->frame + sizeof hdr, &tag, sizeof tag);
+   }
+
+   return sizeof hdr + len;
+}
+
+void
+msg_wire_restore(msg_t *msg, const wire_save_t *save)
+{
+   // Header may have overwritten type, do not look at msg
+   memcpy(save->frame, save->hdr, save->hdr_len);
+   if (save->ack) {
+      msg->status = save->status;
+   }
+}
+
+/*
+  Where a v2 frame must be read, so DATA/ACK payloads are already in place
+*/
+char *
+msg_wire_rx_buf(msg_t *msg)
+{
+   return (char *)&msg->size + MSG_OFFSET(data) - sizeof(wire_hdr_t);
+}
+
+/*
+  Turn a v2 frame read at msg_wire_rx_buf into a msg_t
+*/
+int
+msg_wire_decode(msg_t *msg, size_t len, u8 *flags, u32 *seq)
+{
+   wire_hdr_t hdr;
+   size_t plen;
+
+   if (len < sizeof hdr) {
+      return -EINVAL;
+   }
+   memcpy(&hdr, msg_wire_rx_buf(msg), sizeof hdr);
+   plen = le32_to_cpu(hdr.len);
+   if (hdr.version != WIRE_V2 || plen != len - sizeof hdr) {
+      return -EINVAL;
+   }
+
+   *flags = hdr.flags;
+   *seq = le32_to_cpu(hdr.seq);
+   msg->type = hdr.type;
+   msg->tag = 0;
+
+   switch (hdr.type) {
+   case MANAGEMENT:
+      if (plen > msg->allocated_size) {
+         return -EINVAL;
+      }
+      memmove(msg->management_data, msg->data, plen);
+      msg->management_type = hdr.ep;
+      msg->size = MSG_OFFSET(management_data) + plen;
+      break;
+   case ACK:
+      if (plen < sizeof msg->status) {
+         return -EINVAL;
+      }
+      msg->status = le32_to_cpu((__force __le32)msg->status);
+      // Fall through
+   case DATA:
+   case DELTA:
+      // Tag was read in place of data, buffer has room for WIRE_TAG_LEN more bytes
+      if (hdr.type == DATA && (hdr.flags & WIRE_F_TAG)) {
+         __le32 tag;
+
+         if (plen < sizeof tag) {
+            return -EINVAL;
+         }
+         memcpy(&tag, msg->data, sizeof tag);
+         plen -= sizeof tag;
+         memmove(msg->data, msg->data + sizeof tag, plen);
+         msg->tag = le32_to_cpu(tag);
+      }
+      msg->epid.num = hdr.ep & WIRE_EP_NUM_MASK;
+      msg->epid.type = (hdr.ep & WIRE_EP_TYPE_MASK) >> WIRE_EP_TYPE_SHIFT;
+      msg->epid.dir = hdr.ep & WIRE_EP_DIR ? OUT : IN;
+      msg->size = MSG_OFFSET(data) + plen;
+      break;
+   default:
+      return -EINVAL;
+   }
+
+   return 0;
+}
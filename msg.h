@@ -4,31 +4,72 @@
 
 #include "types.h"
 
-#define MSG_FROM_BUF(b) ((msg_t *)((b)-(sizeof(size_t)+sizeof(size_t)+sizeof(epid_t))))
+#define MSG_FROM_BUF(b) ((msg_t *)((b)-offsetof(msg_t, data)))
 
 typedef enum msg_type_t {
    DATA,
    ACK,
-   MANAGEMENT
+   MANAGEMENT,
+   DELTA  // Interrupt IN DATA given against previous one, see delta_hdr_t
 } msg_type_t;
 
 #define IS_MANAGEMENT_MSG(m) (((m)->type) == MANAGEMENT)
-#define IS_USB_MSG(m) (((m)->type) == DATA || ((m)->type) == ACK)
+#define IS_USB_MSG(m) (((m)->type) == DATA || ((m)->type) == ACK || ((m)->type) == DELTA)
 #define IS_USB_DATA(m) (((m)->type) == DATA)
+#define IS_USB_DELTA(m) (((m)->type) == DELTA)
 #define IS_USB_ACK(m) (((m)->type) == ACK)
 
 typedef enum msg_management_type_t {
    RESET,
    NEW_DEVICE,
    RELOAD,
+   SET_VERSION, // Wire format negotiation, handled by com layer
+   CREDIT,      // Flow control, management_data is a credit_t
+   REL_ACK,     // Reliable delivery acknowledgement, handled by com layer
 } msg_management_type_t;
 
 #define IS_RESET_MNG_MSG(m) (IS_MANAGEMENT_MSG(m) && ((m)->management_type) == RESET)
 #define IS_NEW_DEVICE_MNG_MSG(m) (IS_MANAGEMENT_MSG(m) && ((m)->management_type) == NEW_DEVICE)
 #define IS_RELOAD_MNG_MSG(m) (IS_MANAGEMENT_MSG(m) && ((m)->management_type) == RELOAD)
+#define IS_SET_VERSION_MNG_MSG(m) (IS_MANAGEMENT_MSG(m) && ((m)->management_type) == SET_VERSION)
+#define IS_CREDIT_MNG_MSG(m) (IS_MANAGEMENT_MSG(m) && ((m)->management_type) == CREDIT)
+#define IS_REL_ACK_MNG_MSG(m) (IS_MANAGEMENT_MSG(m) && ((m)->management_type) == REL_ACK)
+
+// Peer may send credits more messages on endpoint
+typedef struct credit_t {
+   epid_t epid;
+   __le32 credits;
+} __attribute__((packed)) credit_t;
+
+// ACK data of IN endpoints, standing for count requests. No data means one
+typedef struct ack_window_t {
+   __le32 count;
+   __le32 bytes;
+} __attribute__((packed)) ack_window_t;
+
+/*
+  DELTA payload: delta_hdr_t then one delta_t per byte that changed
+  (none if same as last payload)
+*/
+typedef struct delta_hdr_t {
+   __le16 len;  // Payload length, same as last one
+   __le32 crc;  // crc32_le of rebuilt payload
+} __attribute__((packed)) delta_hdr_t;
+
+typedef struct delta_t {
+   __le16 offset;
+   u8 xor;
+} __attribute__((packed)) delta_t;
+
+// Every sequence up to cum received, bit i of sack set if cum + 2 + i also is
+typedef struct rel_ack_t {
+   __le32 cum;
+   __le32 sack;
+} __attribute__((packed)) rel_ack_t;
 
 typedef struct msg_t {
    size_t allocated_size;
+   u32 tag; // Userland verdict id of DATA, 0 if none (v2 only, see WIRE_F_TAG)
    size_t size;
    msg_type_t type;
    union {
@@ -55,6 +96,9 @@ typedef struct msg_t {
    } __attribute__((packed));
 } __attribute__((packed)) msg_t;
 
+// Fields before size, never sent
+#define MSG_HEAD_SIZE offsetof(msg_t, size)
+
 size_t msg_get_data_size(const msg_t *msg);
 void msg_set_data_size(msg_t *msg, size_t size);
 char *dump_msg(const msg_t*);
@@ -65,11 +109,61 @@ void msg_set_id(msg_t *msg, const epnum_t num, const eptype_t type, const epdir_
 // Allocate an ACK message for an endpoint
 msg_t* alloc_msg_ack(epid_t *, int, char *, size_t);
 msg_t* alloc_msg_management(size_t);
+msg_t* alloc_msg_credit(const epid_t *, u32);
 msg_t* alloc_msg_data(size_t);
 msg_t* alloc_msg(size_t,int);
+msg_t* dup_msg(const msg_t *m);
 void free_msg(msg_t *m);
 char *msg_get_data(const msg_t* msg);
 
 int check_msg(msg_t *msg);
 
+/*
+  Wire formats
+  v1: msg_t as is, starting at size field (native sizes and endianness)
+  v2: wire_hdr_t followed by payload, little endian
+      DATA: data, ACK: status (le32) then ack data, MANAGEMENT: management data
+      ep is the management type for MANAGEMENT messages
+      Tagged DATA (WIRE_F_TAG): le32 tag before data, included in len
+*/
+#define WIRE_V1 1
+#define WIRE_V2 2
+#define WIRE_MIN_HDR 8 // Bytes needed to know frame length, whatever the version
+
+#define WIRE_EP_NUM_MASK 0x0f
+#define WIRE_EP_TYPE_SHIFT 4
+#define WIRE_EP_TYPE_MASK 0x30
+#define WIRE_EP_DIR 0x80
+
+#define WIRE_F_REL 0x01 // Frame must be acknowledged with a REL_ACK, in v2 only
+#define WIRE_F_LZ4 0x02 // DATA payload is LZ4 compressed, len is the compressed length
+#define WIRE_F_PRIO 0x04 // Control, interrupt or management, need not wait for bulk frames
+#define WIRE_F_TAG 0x08 // DATA waits for a userland verdict, which must echo its tag
+
+#define WIRE_TAG_LEN sizeof(__le32)
+
+typedef struct wire_hdr_t {
+   u8 version;
+   u8 flags;
+   u8 type;
+   u8 ep;
+   __le32 len; // Payload length
+   __le32 seq;
+} __attribute__((packed)) wire_hdr_t;
+
+// Bytes of msg_t overwritten by an in place v2 header
+typedef struct wire_save_t {
+   char *frame;
+   size_t hdr_len;
+   char hdr[sizeof(wire_hdr_t) + WIRE_TAG_LEN];
+   int ack;
+   int status;
+} wire_save_t;
+
+size_t msg_frame_len(int version, const char *buf);
+size_t msg_wire_encode(msg_t *msg, u8 flags, u32 seq, wire_save_t *save);
+void msg_wire_restore(msg_t *msg, const wire_save_t *save);
+char *msg_wire_rx_buf(msg_t *msg);
+int msg_wire_decode(msg_t *msg, size_t len, u8 *flags, u32 *seq);
+
 #endif
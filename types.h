@@ -2,8 +2,12 @@
 
 #define __USBMITM_TYPES_H
 
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/atomic.h>
 #include <linux/usb/ch9.h>
 #include <linux/workqueue.h>
+#include <linux/hrtimer.h>
 #include "msg.h"
 
 #define MAX_INTERFACE_CONFIGURATION 64
@@ -62,8 +66,27 @@ typedef struct ep_t {
    const struct usb_endpoint_descriptor *desc;
    struct list_head list;
    struct list_head reqlist;
+   spinlock_t reqlist_lock; // Requests are freed from completion context too
    struct workqueue_struct *wq;
    char *name;
+   void *ctx;    // Instance owning the endpoint
+   spinlock_t credit_lock;
+   int credits;  // Messages peer can still take (flow control)
+   int starved;  // Resubmit/refill postponed until credits come back
+   struct mutex delta_lock;
+   char *delta_last; // Last interrupt IN payload, base of DELTA messages
+   size_t delta_len;
+   size_t delta_size;
+   int delta_valid;
+   atomic_t latest_gen; // Interrupt IN reports completed (latest value policy)
+   atomic64_t superseded; // Reports dropped because a newer one was there, from completion and workqueue
+   struct mutex verdict_lock;   // Serializes userland verdicts and fallbacks
+   spinlock_t verdict_list_lock;
+   struct list_head verdicts;   // Messages of the other half under deadline, oldest first
+   int verdict_dying;           // Endpoint is being freed, nothing is kept anymore
+   struct hrtimer verdict_timer;
+   struct work_struct verdict_work;
+   u64 expired;                 // Messages forwarded without userland
 } ep_t;
 
 
@@ -71,6 +94,7 @@ typedef struct interface_desc_t {
    struct usb_interface_descriptor desc;
    struct usb_endpoint_descriptor endpoints[MAX_ENDPOINT_INTERFACE];
    int active;
+   int target; // Scratch, active once interface activation is done
 } interface_desc_t;
 
 